@@ -0,0 +1,610 @@
+// Microbenchmarks for the native hot paths, built from main.cpp without its main().
+// Runs against an offscreen GL context with fixed inputs and prints JSON:
+//   pobbench [--headless] [--filter substring] [--min-time ms] [--out file]
+// Run from a Path of Building directory to also compare against its base64.lua and xml.lua.
+#include <QFile>
+#include <QFontDatabase>
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QProcess>
+#include <QSurfaceFormat>
+#include <QThread>
+#include <QtGui/QGuiApplication>
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "compress.hpp"
+#include "luaalloc.hpp"
+#include "main.h"
+#include "pobwindow.hpp"
+
+// Defined in main.cpp
+extern lua_State* L;
+extern LuaAllocator luaAllocator;
+extern POBWindow* pobwindow;
+void RegisterNatives();
+
+namespace {
+
+const int WIDTH = 1280;
+const int HEIGHT = 720;
+
+struct Result {
+    QByteArray name;
+    qint64 iterations;
+    int batches;
+    double medianNs;
+    double minNs;
+    double meanNs;
+};
+
+struct MemoryResult {
+    QByteArray name;
+    qint64 peakRssKb;
+    qint64 luaKb;
+    qint64 reservedKb;
+};
+
+class Bench {
+public:
+    Bench(const QByteArray& Filter, qint64 MinTimeMs) : filter(Filter), minTimeNs(MinTimeMs * 1000000) {}
+
+    // Times body in batches of at least a millisecond each until minTime has passed;
+    // per-op figures are taken across batches so timer overhead doesn't dominate small ops
+    void run(const QByteArray& name, const std::function<void()>& body) {
+        if (!filter.isEmpty() && !name.contains(filter)) {
+            return;
+        }
+        body();
+        qint64 batchSize = 1;
+        QElapsedTimer timer;
+        for (;;) {
+            timer.start();
+            for (qint64 i = 0; i < batchSize; i++) {
+                body();
+            }
+            if (timer.nsecsElapsed() >= 1000000 || batchSize >= (1 << 24)) {
+                break;
+            }
+            batchSize *= 2;
+        }
+        std::vector<double> perOp;
+        qint64 total = 0;
+        while (total < minTimeNs || perOp.size() < 10) {
+            timer.start();
+            for (qint64 i = 0; i < batchSize; i++) {
+                body();
+            }
+            qint64 ns = timer.nsecsElapsed();
+            total += ns;
+            perOp.push_back((double)ns / batchSize);
+        }
+        std::vector<double> sorted(perOp);
+        std::sort(sorted.begin(), sorted.end());
+        results.push_back({name, batchSize * (qint64)perOp.size(), (int)perOp.size(), sorted[sorted.size() / 2], sorted.front(),
+                           (double)total / (batchSize * perOp.size())});
+        std::cerr << name.constData() << ": " << sorted[sorted.size() / 2] << " ns/op" << std::endl;
+    }
+
+    bool wants(const QByteArray& name) const {
+        return filter.isEmpty() || name.contains(filter);
+    }
+
+    void memory(const MemoryResult& result) {
+        memoryResults.push_back(result);
+        std::cerr << result.name.constData() << ": peak RSS +" << result.peakRssKb << " KiB, Lua heap " << result.luaKb << " KiB";
+        if (result.reservedKb >= 0) {
+            std::cerr << ", pool reserved " << result.reservedKb << " KiB";
+        }
+        std::cerr << std::endl;
+    }
+
+    QByteArray json(const QByteArray& renderer) const {
+        QByteArray out = "{\n  \"context\": {\"qt\": \"" + QByteArray(qVersion()) + "\", \"gl_renderer\": \"" + escape(renderer) +
+                         "\", \"width\": " + QByteArray::number(WIDTH) + ", \"height\": " + QByteArray::number(HEIGHT) +
+                         ", \"pooled_allocator\": " + (luaAllocator.active ? "true" : "false") + "},\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            out += i ? ",\n    " : "\n    ";
+            out += "{\"name\": \"" + r.name + "\", \"iterations\": " + QByteArray::number(r.iterations) +
+                   ", \"batches\": " + QByteArray::number(r.batches) +
+                   ", \"ns_per_op\": " + QByteArray::number(r.medianNs, 'f', 1) +
+                   ", \"ns_per_op_min\": " + QByteArray::number(r.minNs, 'f', 1) +
+                   ", \"ns_per_op_mean\": " + QByteArray::number(r.meanNs, 'f', 1) + "}";
+        }
+        out += "\n  ],\n  \"memory\": [";
+        for (size_t i = 0; i < memoryResults.size(); i++) {
+            const MemoryResult& r = memoryResults[i];
+            out += i ? ",\n    " : "\n    ";
+            out += "{\"name\": \"" + r.name + "\", \"peak_rss_growth_kb\": " + QByteArray::number(r.peakRssKb) +
+                   ", \"lua_heap_kb\": " + QByteArray::number(r.luaKb);
+            if (r.reservedKb >= 0) {
+                out += ", \"pool_reserved_kb\": " + QByteArray::number(r.reservedKb);
+            }
+            out += "}";
+        }
+        out += "\n  ]\n}\n";
+        return out;
+    }
+
+private:
+    static QByteArray escape(QByteArray s) {
+        return s.replace('\\', "\\\\").replace('"', "\\\"");
+    }
+
+    QByteArray filter;
+    qint64 minTimeNs;
+    std::vector<Result> results;
+    std::vector<MemoryResult> memoryResults;
+};
+
+// Deterministic stand-in for a saved build: nested elements with varying attributes and text
+QByteArray MakeBuildXML(int items)
+{
+    uint32_t seed = 12345;
+    auto next = [&seed]() {
+        seed = seed * 1103515245 + 12345;
+        return (int)((seed >> 16) & 0x7fff);
+    };
+    QByteArray xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<PathOfBuilding>\n"
+                     "<Build level=\"92\" targetVersion=\"3_0\" className=\"Witch\" ascendClassName=\"Necromancer\">\n";
+    for (int i = 0; i < items; i++) {
+        xml += "<Item id=\"" + QByteArray::number(i) + "\" variant=\"" + QByteArray::number(next() % 8) + "\">\n";
+        xml += "Rarity: RARE\nDoom Veil &amp; Hood\nQuality: " + QByteArray::number(next() % 21) + "\n";
+        for (int m = 0; m < 6; m++) {
+            xml += "+" + QByteArray::number(next() % 120) + " to maximum Life &lt;" + QByteArray::number(m) + "&gt;\n";
+        }
+        xml += "</Item>\n";
+    }
+    xml += "</Build>\n</PathOfBuilding>\n";
+    return xml;
+}
+
+void CallGlobal(const char* name, int nargs, const std::function<void()>& pushArgs)
+{
+    lua_getglobal(L, name);
+    pushArgs();
+    if (lua_pcall(L, nargs, 0, 0)) {
+        std::cerr << name << ": " << lua_tostring(L, -1) << std::endl;
+        exit(1);
+    }
+}
+
+// Loads one of the runtime's Lua modules into a global for the benches that compare against it.
+// They ship with Path of Building rather than the frontend, so those benches only run when
+// pobbench is started from a Path of Building directory.
+bool RequireRuntimeModule(const char* name, const char* global)
+{
+    lua_getglobal(L, "require");
+    lua_pushstring(L, name);
+    if (lua_pcall(L, 1, 1, 0)) {
+        std::cerr << "Skipping the comparison with " << name << ".lua: " << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+        return false;
+    }
+    lua_setglobal(L, global);
+    return true;
+}
+
+// Calculation-style Lua work for comparing allocators: lists of small mod tables summed into a
+// keyed table, plus the string and table churn of BenchChurn()
+const char* ALLOC_WORKLOAD =
+    "function BenchChurn() local t = {} for i = 1, 1000 do t[i] = { i, tostring(i) } end return t end "
+    "function BenchCalc() local mods = {} for i = 1, 2000 do "
+    "mods[i] = { name = 'Life' .. (i % 50), type = 'INC', value = i % 7, flags = i % 3, tags = { i } } end "
+    "local sum = {} for _, m in ipairs(mods) do sum[m.name] = (sum[m.name] or 0) + m.value * (1 + m.flags / 100) end return sum end "
+    "function BenchAllocWorkload() local keep = {} for r = 1, 400 do keep[r % 20 + 1] = BenchCalc() BenchChurn() end "
+    "collectgarbage('collect') end";
+
+// A state set up like the main one, on the pooled allocator or on LuaJIT's own
+lua_State* NewWorkloadState(LuaAllocator* pool)
+{
+    lua_State* S = pool ? pool->newState() : luaL_newstate();
+    luaL_openlibs(S);
+    luaJIT_setmode(S, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
+    luaL_dostring(S, ALLOC_WORKLOAD);
+    return S;
+}
+
+void CallIn(lua_State* S, const char* name)
+{
+    lua_getglobal(S, name);
+    if (lua_pcall(S, 0, 0, 0)) {
+        std::cerr << name << ": " << lua_tostring(S, -1) << std::endl;
+        exit(1);
+    }
+}
+
+qint64 MaxRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+// pobbench --alloc-memory default|pooled: runs the allocator workload in this otherwise idle
+// process and prints peak RSS growth, the Lua heap size and the pool's reserved slabs in KiB
+int RunAllocMemory(const char* mode)
+{
+    qint64 before = MaxRssKb();
+    LuaAllocator pool;
+    bool pooled = !strcmp(mode, "pooled");
+    lua_State* S = NewWorkloadState(pooled ? &pool : nullptr);
+    CallIn(S, "BenchAllocWorkload");
+    std::cout << MaxRssKb() - before << " " << lua_gc(S, LUA_GCCOUNT, 0) << " "
+              << (pool.active ? (qint64)(pool.reserved >> 10) : -1) << std::endl;
+    lua_close(S);
+    return 0;
+}
+
+// Peak RSS is per process, so each allocator is measured in a fresh child started from the same point
+bool MeasureAllocMemory(const char* mode, MemoryResult& result)
+{
+    QProcess child;
+    child.start(QCoreApplication::applicationFilePath(), QStringList() << "--alloc-memory" << mode);
+    if (!child.waitForFinished(120000) || child.exitCode() != 0) {
+        std::cerr << "--alloc-memory " << mode << " failed" << std::endl;
+        return false;
+    }
+    QList<QByteArray> fields = child.readAllStandardOutput().simplified().split(' ');
+    if (fields.size() != 3) {
+        return false;
+    }
+    result.peakRssKb = fields[0].toLongLong();
+    result.luaKb = fields[1].toLongLong();
+    result.reservedKb = fields[2].toLongLong();
+    return true;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    QByteArray filter;
+    qint64 minTimeMs = 200;
+    QString outPath;
+    if (argc == 3 && !strcmp(argv[1], "--alloc-memory")) {
+        return RunAllocMemory(argv[2]);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless") && !qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            minTimeMs = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            outPath = argv[++i];
+        }
+    }
+
+    QGuiApplication app{argc, argv};
+
+    // The renderer still uses fixed function GL, so ask for a compatibility context
+    QSurfaceFormat format;
+    format.setProfile(QSurfaceFormat::CompatibilityProfile);
+    QOffscreenSurface surface;
+    surface.setFormat(format);
+    surface.create();
+    QOpenGLContext context;
+    context.setFormat(format);
+    if (!context.create() || !context.makeCurrent(&surface)) {
+        std::cerr << "Can't create an OpenGL context" << std::endl;
+        return 1;
+    }
+    QOpenGLFramebufferObject fbo(WIDTH, HEIGHT);
+    fbo.bind();
+
+    for (const char* name : {"VeraMono.ttf", "LiberationSans-Regular.ttf", "LiberationSans-Bold.ttf"}) {
+        QFile file(name);
+        if (file.open(QFile::ReadOnly)) {
+            QFontDatabase::addApplicationFontFromData(file.readAll());
+        }
+    }
+
+    pobwindow = new POBWindow;
+    pobwindow->initializeGL();
+    pobwindow->resizeGL(WIDTH, HEIGHT);
+    glViewport(0, 0, WIDTH, HEIGHT);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, WIDTH, HEIGHT, 0, -9999, 9999);
+    glMatrixMode(GL_MODELVIEW);
+
+    L = luaAllocator.newState();
+    luaL_openlibs(L);
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
+    RegisterNatives();
+
+    Bench bench(filter, minTimeMs);
+    const char* renderer = (const char*)glGetString(GL_RENDERER);
+
+    // Text
+    const char* label = "^7Life: ^x33FF77+1234 ^8(^4Fire Resistance^8)";
+    pobwindow->stringCache.setMaxCost(1000);
+    bench.run("draw_string_cmd_cached", [label]() {
+        DrawStringCmd cmd(10, 10, F_LEFT, 16, F_VAR, label);
+    });
+    bench.run("draw_string_cmd_uncached", [label]() {
+        pobwindow->stringCache.clear();
+        DrawStringCmd cmd(10, 10, F_LEFT, 16, F_VAR, label);
+        cmd.execute();
+    });
+    // A freshly opened tooltip: every line is new, and the rasterization overlaps across workers
+    bench.run("draw_string_burst_40", []() {
+        pobwindow->stringCache.clear();
+        std::vector<std::unique_ptr<DrawStringCmd>> cmds;
+        for (int i = 0; i < 40; i++) {
+            QByteArray line = "^7Line " + QByteArray::number(i) + ": ^x8888FF+" + QByteArray::number(i * 37) + "% increased Damage";
+            cmds.push_back(std::make_unique<DrawStringCmd>(10, 10 + i * 16, F_LEFT, 16, F_VAR, line.constData()));
+        }
+        for (auto& cmd : cmds) {
+            cmd->execute();
+        }
+    });
+    // A 40-line tooltip where one stat changes between frames; only that line is rasterized again
+    QByteArray tooltip;
+    for (int i = 0; i < 39; i++) {
+        tooltip += "^7Line " + QByteArray::number(i) + ": ^x8888FF+" + QByteArray::number(i * 37) + "% increased Damage\n";
+    }
+    int tooltipFrame = 0;
+    bench.run("draw_string_tooltip_40_one_changed", [&tooltip, &tooltipFrame]() {
+        QByteArray text = tooltip + "^7Total DPS: " + QByteArray::number(tooltipFrame++);
+        DrawStringCmd cmd(10, 10, F_LEFT, 16, F_VAR, text.constData());
+        cmd.execute();
+    });
+    bench.run("strip_escapes", [label]() {
+        CallGlobal("StripEscapes", 1, [label]() { lua_pushstring(L, label); });
+    });
+    bench.run("draw_string_width_cached", [label]() {
+        CallGlobal("DrawStringWidth", 3, [label]() { lua_pushinteger(L, 16); lua_pushstring(L, "VAR"); lua_pushstring(L, label); });
+    });
+    bench.run("draw_string_width_uncached", [label]() {
+        pobwindow->stringCache.clear();
+        CallGlobal("DrawStringWidth", 3, [label]() { lua_pushinteger(L, 16); lua_pushstring(L, "VAR"); lua_pushstring(L, label); });
+    });
+
+    // Compression across payload sizes either side of PARALLEL_DEFLATE_MIN (1 MiB): one-shot calls,
+    // the streaming handles fed 64 KiB at a time, and above the threshold a sweep of deflate thread counts
+    QByteArray xml = MakeBuildXML(400);
+    QByteArray sizedXml = MakeBuildXML(60000);
+    luaL_dostring(L, "function BenchStreamDeflate(s) local d = NewDeflater() "
+                     "for i = 1, #s, 65536 do d:Write(s:sub(i, i + 65535)) end return d:Finish() end "
+                     "function BenchStreamInflate(s) local f = NewInflater() "
+                     "for i = 1, #s, 65536 do f:Write(s:sub(i, i + 65535)) end assert(f:IsFinished()) end");
+    for (int size : {16 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20}) {
+        QByteArray data = sizedXml.left(size);
+        QByteArray label = size >= (1 << 20) ? QByteArray::number(size >> 20) + "m" : QByteArray::number(size >> 10) + "k";
+        bench.run("deflate_" + label, [&data]() {
+            CallGlobal("Deflate", 1, [&data]() { lua_pushlstring(L, data.constData(), data.size()); });
+        });
+        lua_getglobal(L, "Deflate");
+        lua_pushlstring(L, data.constData(), data.size());
+        lua_call(L, 1, 1);
+        size_t len;
+        const char* deflated = lua_tolstring(L, -1, &len);
+        QByteArray compressed(deflated, (int)len);
+        lua_pop(L, 1);
+        bench.run("inflate_" + label, [&compressed]() {
+            CallGlobal("Inflate", 1, [&compressed]() { lua_pushlstring(L, compressed.constData(), compressed.size()); });
+        });
+        bench.run("stream_deflate_" + label, [&data]() {
+            CallGlobal("BenchStreamDeflate", 1, [&data]() { lua_pushlstring(L, data.constData(), data.size()); });
+        });
+        bench.run("stream_inflate_" + label, [&compressed]() {
+            CallGlobal("BenchStreamInflate", 1, [&compressed]() { lua_pushlstring(L, compressed.constData(), compressed.size()); });
+        });
+        if (size < (int)PARALLEL_DEFLATE_MIN) {
+            continue;
+        }
+        std::vector<int> threadCounts;
+        for (int threads = 1; threads < QThread::idealThreadCount(); threads *= 2) {
+            threadCounts.push_back(threads);
+        }
+        threadCounts.push_back(QThread::idealThreadCount());
+        for (int threads : threadCounts) {
+            bench.run("deflate_" + label + "_threads_" + QByteArray::number(threads), [&data, threads]() {
+                CallGlobal("Deflate", 3, [&data, threads]() {
+                    lua_pushlstring(L, data.constData(), data.size());
+                    lua_pushnil(L);
+                    lua_pushinteger(L, threads);
+                });
+            });
+        }
+    }
+    bench.run("encode_build_code", [&xml]() {
+        CallGlobal("EncodeBuildCode", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+    });
+    lua_getglobal(L, "EncodeBuildCode");
+    lua_pushlstring(L, xml.constData(), xml.size());
+    lua_call(L, 1, 1);
+    QByteArray code = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    bench.run("decode_build_code", [&code]() {
+        CallGlobal("DecodeBuildCode", 1, [&code]() { lua_pushlstring(L, code.constData(), code.size()); });
+    });
+    // The Lua path the natives replace: Deflate(), then base64.lua and the URL-safe substitutions.
+    // Each side has to decode the other's codes back to the same XML before either is timed.
+    if (RequireRuntimeModule("base64", "base64")) {
+        luaL_dostring(L, "function BenchLuaEncodeBuildCode(xml) return (base64.encode(Deflate(xml)):gsub('+', '-'):gsub('/', '_')) end "
+                         "function BenchLuaDecodeBuildCode(code) return Inflate(base64.decode((code:gsub('-', '+'):gsub('_', '/')))) end "
+                         "function BenchCheckBuildCode(xml) "
+                         "assert(DecodeBuildCode(BenchLuaEncodeBuildCode(xml)) == xml, 'DecodeBuildCode() of the Lua build code differs') "
+                         "assert(BenchLuaDecodeBuildCode(EncodeBuildCode(xml)) == xml, 'Lua decode of the EncodeBuildCode() result differs') end");
+        CallGlobal("BenchCheckBuildCode", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+        bench.run("encode_build_code_lua", [&xml]() {
+            CallGlobal("BenchLuaEncodeBuildCode", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+        });
+        bench.run("decode_build_code_lua", [&code]() {
+            CallGlobal("BenchLuaDecodeBuildCode", 1, [&code]() { lua_pushlstring(L, code.constData(), code.size()); });
+        });
+    }
+    bench.run("parse_xml", [&xml]() {
+        CallGlobal("ParseXML", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+    });
+    // xml.lua from the runtime on the same document; the two trees have to match exactly first
+    if (RequireRuntimeModule("xml", "xml")) {
+        luaL_dostring(L, "local function same(a, b, path) "
+                         "if type(a) ~= type(b) then error(path .. ': ' .. type(a) .. ' from ParseXML(), ' .. type(b) .. ' from xml.lua') end "
+                         "if type(a) ~= 'table' then "
+                         "if a ~= b then error(path .. ': ' .. tostring(a) .. ' from ParseXML(), ' .. tostring(b) .. ' from xml.lua') end return end "
+                         "for k, v in pairs(a) do same(v, b[k], path .. '.' .. tostring(k)) end "
+                         "for k, v in pairs(b) do if a[k] == nil then same(nil, v, path .. '.' .. tostring(k)) end end end "
+                         "function BenchCheckXML(text) local native, err = ParseXML(text) assert(native, err) "
+                         "local lua, luaErr = xml.ParseXML(text) assert(lua, luaErr) same(native, lua, 'nodes') end "
+                         "function BenchLuaParseXML(text) return xml.ParseXML(text) end");
+        CallGlobal("BenchCheckXML", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+        bench.run("parse_xml_lua", [&xml]() {
+            CallGlobal("BenchLuaParseXML", 1, [&xml]() { lua_pushlstring(L, xml.constData(), xml.size()); });
+        });
+    }
+
+    // ParallelMap scaling: the same CPU-bound map over 64 inputs at 1 to idealThreadCount() threads,
+    // waiting on the event loop for the callback as the window would
+    luaL_dostring(L, "BenchMapInputs = {} for i = 1, 64 do BenchMapInputs[i] = i end "
+                     "BenchMapScript = 'local n = ... local s = 0 for i = 1, 20000 do s = s + math.sqrt(i * n) end return s' "
+                     "function BenchMap(threads) BenchMapDone = false "
+                     "ParallelMap(BenchMapScript, BenchMapInputs, { threads = threads, chunkSize = 1, "
+                     "callback = function() BenchMapDone = true end }) end");
+    for (int threads = 1; threads <= QThread::idealThreadCount(); threads++) {
+        bench.run("parallel_map_64_threads_" + QByteArray::number(threads), [threads]() {
+            CallGlobal("BenchMap", 1, [threads]() { lua_pushinteger(L, threads); });
+            for (;;) {
+                lua_getglobal(L, "BenchMapDone");
+                bool done = lua_toboolean(L, -1);
+                lua_pop(L, 1);
+                if (done) {
+                    break;
+                }
+                QGuiApplication::processEvents(QEventLoop::WaitForMoreEvents);
+            }
+        });
+    }
+
+    // Lua allocation churn: many small tables and strings, mostly from the pooled size classes
+    luaL_dostring(L, ALLOC_WORKLOAD);
+    bench.run("lua_alloc_churn_1000", []() {
+        CallGlobal("BenchChurn", 0, []() {});
+    });
+
+    // The same churn and a calculation-style workload on fresh states with LuaJIT's allocator and
+    // the pooled one, then the workload's peak RSS growth and heap for each in a child process
+    LuaAllocator workloadPool;
+    lua_State* defaultState = NewWorkloadState(nullptr);
+    lua_State* pooledState = NewWorkloadState(&workloadPool);
+    for (auto state : {std::make_pair(QByteArray("default"), defaultState), std::make_pair(QByteArray("pooled"), pooledState)}) {
+        if (state.first == "pooled" && !workloadPool.active) {
+            std::cerr << "This LuaJIT can't take a custom allocator; skipping the pooled runs" << std::endl;
+            continue;
+        }
+        lua_State* S = state.second;
+        bench.run("lua_alloc_churn_1000_" + state.first, [S]() {
+            CallIn(S, "BenchChurn");
+        });
+        bench.run("lua_calc_2000_mods_" + state.first, [S]() {
+            CallIn(S, "BenchCalc");
+        });
+        MemoryResult memory{"lua_alloc_workload_" + state.first, 0, 0, -1};
+        if (bench.wants(memory.name) && MeasureAllocMemory(state.first.constData(), memory)) {
+            bench.memory(memory);
+        }
+    }
+    lua_close(defaultState);
+    lua_close(pooledState);
+
+    // Data tables: building 20000 entries in Lua, against opening a data pack of them and reading 100
+    luaL_dostring(L, "function BenchDataTable() local t = {} for i = 1, 20000 do "
+                     "t['Gem' .. i] = { name = 'Gem ' .. i, level = i % 20, tags = { 'a', 'b', fire = i % 2 == 0 } } end return t end "
+                     "BenchPackPath = os.tmpname() WriteDataPack(BenchPackPath, BenchDataTable()) "
+                     "function BenchDataPack() local t = OpenDataPack(BenchPackPath) local n = 0 "
+                     "for i = 1, 20000, 200 do n = n + t['Gem' .. i].level end return n end");
+    bench.run("data_table_build_20000", []() {
+        CallGlobal("BenchDataTable", 0, []() {});
+    });
+    bench.run("data_pack_open_read_100", []() {
+        CallGlobal("BenchDataPack", 0, []() {});
+    });
+    luaL_dostring(L, "os.remove(BenchPackPath)");
+
+    // Draw commands: 10000 quads appended and executed directly, then a whole frame of them from Lua,
+    // then the same quads replayed from a draw list
+    const int QUADS = 10000;
+    bench.run("quads_append_execute_10000", []() {
+        for (auto& layer : pobwindow->layers) {
+            layer.second.clear();
+        }
+        for (int i = 0; i < QUADS; i++) {
+            float x = (float)(i % 100) * 12;
+            float y = (float)(i / 100) * 7;
+            pobwindow->AppendCmd(std::make_unique<DrawImageQuadCmd>(pobwindow->white, x, y, x + 10, y, x + 10, y + 6, x, y + 6));
+        }
+        for (auto& layer : pobwindow->layers) {
+            for (auto& cmd : layer.second) {
+                cmd->execute();
+            }
+        }
+        glFinish();
+    });
+    luaL_dostring(L, "SetMainObject({ OnFrame = function() "
+                     "for i = 0, 9999 do local x, y = (i % 100) * 12, math.floor(i / 100) * 7 "
+                     "DrawImageQuad(nil, x, y, x + 10, y, x + 10, y + 6, x, y + 6) end end })");
+    pobwindow->luaReady = true;
+    bench.run("frame_lua_quads_10000", []() {
+        pobwindow->paintGL();
+        glFinish();
+    });
+
+    luaL_dostring(L, "local list = NewDrawList() SetMainObject({ OnFrame = function() "
+                     "if not list:IsValid() then list:BeginRecording() "
+                     "for i = 0, 9999 do local x, y = (i % 100) * 12, math.floor(i / 100) * 7 "
+                     "DrawImageQuad(nil, x, y, x + 10, y, x + 10, y + 6, x, y + 6) end list:EndRecording() end "
+                     "list:Draw(0, 0, 1) end })");
+    bench.run("frame_draw_list_10000", []() {
+        pobwindow->paintGL();
+        glFinish();
+    });
+
+    // Texture uploads: a 1024x1024 image through the PBO ring in one go, then spread over
+    // frames at the default budget
+    QImage uploadImage(1024, 1024, QImage::Format_RGBA8888);
+    uploadImage.fill(0x80808080);
+    bench.run("texture_upload_1024", [&uploadImage]() {
+        auto upload = std::make_shared<TextureUpload>(uploadImage);
+        pobwindow->textureUploader.uploadNow(upload, pobwindow->white);
+        glFinish();
+    });
+    bench.run("texture_upload_budgeted_4x1024", [&uploadImage]() {
+        std::vector<std::shared_ptr<TextureUpload>> uploads;
+        for (int i = 0; i < 4; i++) {
+            uploads.push_back(std::make_shared<TextureUpload>(uploadImage));
+            pobwindow->textureUploader.enqueue(uploads.back());
+        }
+        while (pobwindow->textureUploader.process(pobwindow->white)) {
+        }
+        glFinish();
+    });
+
+    QByteArray json = bench.json(renderer ? renderer : "unknown");
+    if (outPath.isEmpty()) {
+        std::cout << json.constData();
+    } else {
+        QFile out(outPath);
+        if (!out.open(QFile::WriteOnly | QFile::Truncate)) {
+            std::cerr << "Can't write " << outPath.toStdString() << std::endl;
+            return 1;
+        }
+        out.write(json);
+    }
+    return 0;
+}
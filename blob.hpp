@@ -0,0 +1,169 @@
+#ifndef BLOB_HPP
+#define BLOB_HPP
+
+#include <QByteArray>
+
+#include <new>
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// =====
+// Blobs
+// =====
+
+// Immutable bytes that can be handed between lua_States without copying.
+// The QByteArray is never written to after construction, so every copy
+// shares (and reference counts) the same storage; a blob may view a slice of it.
+struct blob_s {
+    QByteArray data;
+    int offset;
+    int length;
+
+    const char* begin() const {
+        return data.constData() + offset;
+    }
+};
+
+static blob_s* PushBlob(lua_State* L, const QByteArray& data, int offset, int length)
+{
+    auto blob = (blob_s*)lua_newuserdata(L, sizeof(blob_s));
+    new (blob) blob_s{data, offset, length};
+    lua_getfield(L, LUA_REGISTRYINDEX, "uiblobmeta");
+    lua_setmetatable(L, -2);
+    return blob;
+}
+
+static blob_s* PushBlob(lua_State* L, const QByteArray& data)
+{
+    return PushBlob(L, data, 0, data.size());
+}
+
+static blob_s* ToBlob(lua_State* L, int index)
+{
+    if (lua_type(L, index) != LUA_TUSERDATA || lua_getmetatable(L, index) == 0) {
+        return nullptr;
+    }
+    lua_getfield(L, LUA_REGISTRYINDEX, "uiblobmeta");
+    int ret = lua_rawequal(L, -2, -1);
+    lua_pop(L, 2);
+    return ret ? (blob_s*)lua_touserdata(L, index) : nullptr;
+}
+
+// Length-aware view of a string or blob argument
+static const char* ToBytes(lua_State* L, int index, size_t* len)
+{
+    if (blob_s* blob = ToBlob(L, index)) {
+        *len = blob->length;
+        return blob->begin();
+    }
+    return lua_tolstring(L, index, len);
+}
+
+static blob_s* GetBlob(lua_State* L, const char* method)
+{
+    blob_s* blob = ToBlob(L, 1);
+    if (!blob) {
+        luaL_error(L, "blob:%s() must be used on a blob", method);
+    }
+    return blob;
+}
+
+static int l_NewBlob(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1 || !(lua_isstring(L, 1) || ToBlob(L, 1))) {
+        return luaL_error(L, "Usage: NewBlob(string)");
+    }
+    if (ToBlob(L, 1)) {
+        lua_settop(L, 1);
+        return 1;
+    }
+    size_t len;
+    const char* str = lua_tolstring(L, 1, &len);
+    PushBlob(L, QByteArray(str, (int)len));
+    return 1;
+}
+
+static int l_blobGC(lua_State* L)
+{
+    blob_s* blob = GetBlob(L, "__gc");
+    blob->~blob_s();
+    return 0;
+}
+
+static int l_blobLen(lua_State* L)
+{
+    blob_s* blob = GetBlob(L, "Len");
+    lua_pushinteger(L, blob->length);
+    return 1;
+}
+
+static int l_blobToString(lua_State* L)
+{
+    blob_s* blob = GetBlob(L, "ToString");
+    lua_pushlstring(L, blob->begin(), blob->length);
+    return 1;
+}
+
+// Translate string.sub style indices into a [start, end) range
+static void BlobRange(blob_s* blob, lua_Integer i, lua_Integer j, int& start, int& end)
+{
+    if (i < 0) i += blob->length + 1;
+    if (j < 0) j += blob->length + 1;
+    if (i < 1) i = 1;
+    if (j > blob->length) j = blob->length;
+    start = (int)i - 1;
+    end = j >= i ? (int)j : start;
+}
+
+static int l_blobSub(lua_State* L)
+{
+    blob_s* blob = GetBlob(L, "Sub");
+    int start, end;
+    BlobRange(blob, luaL_optinteger(L, 2, 1), luaL_optinteger(L, 3, -1), start, end);
+    PushBlob(L, blob->data, blob->offset + start, end - start);
+    return 1;
+}
+
+static int l_blobByte(lua_State* L)
+{
+    blob_s* blob = GetBlob(L, "Byte");
+    lua_Integer i = luaL_optinteger(L, 2, 1);
+    int start, end;
+    BlobRange(blob, i, luaL_optinteger(L, 3, i), start, end);
+    luaL_checkstack(L, end - start, "blob:Byte(): slice too long");
+    for (int c = start; c < end; c++) {
+        lua_pushinteger(L, (unsigned char)blob->begin()[c]);
+    }
+    return end - start;
+}
+
+// Registers the blob metatable and NewBlob() in a state; used by the main state and every sub script worker
+static void RegisterBlob(lua_State* L)
+{
+    luaL_newmetatable(L, "uiblobmeta");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_blobGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_blobLen);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, l_blobToString);
+    lua_setfield(L, -2, "__tostring");
+    lua_pushcfunction(L, l_blobLen);
+    lua_setfield(L, -2, "Len");
+    lua_pushcfunction(L, l_blobToString);
+    lua_setfield(L, -2, "ToString");
+    lua_pushcfunction(L, l_blobSub);
+    lua_setfield(L, -2, "Sub");
+    lua_pushcfunction(L, l_blobByte);
+    lua_setfield(L, -2, "Byte");
+    lua_pop(L, 1);
+    lua_pushcfunction(L, l_NewBlob);
+    lua_setglobal(L, "NewBlob");
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef BUILDCODE_HPP
+#define BUILDCODE_HPP
+
+#include <QByteArray>
+
+#include <cstdint>
+
+#include "compress.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// ===========
+// Build codes
+// ===========
+
+// Build codes are deflated XML in URL-safe base64 ('-' and '_' for '+' and '/', '=' padded).
+// Both directions run in one native call; the only Lua string created is the result.
+
+static const char BUILD_CODE_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// Two output characters per 12 bits of input, so each 3 byte group costs two lookups
+static const uint16_t* BuildCodeEncodeTable()
+{
+    static const struct Table {
+        Table() {
+            for (int i = 0; i < 4096; i++) {
+                char pair[2] = {BUILD_CODE_ALPHABET[i >> 6], BUILD_CODE_ALPHABET[i & 63]};
+                memcpy(&entries[i], pair, 2);
+            }
+        }
+        uint16_t entries[4096];
+    } table;
+    return table.entries;
+}
+
+// Sextet for each input byte; accepts the standard alphabet too. -1 is invalid, -2 is skipped whitespace.
+static const int8_t* BuildCodeDecodeTable()
+{
+    static const struct Table {
+        Table() {
+            memset(entries, -1, sizeof(entries));
+            for (int i = 0; i < 64; i++) {
+                entries[(unsigned char)BUILD_CODE_ALPHABET[i]] = (int8_t)i;
+            }
+            entries[(unsigned char)'+'] = 62;
+            entries[(unsigned char)'/'] = 63;
+            for (char c : {' ', '\t', '\r', '\n'}) {
+                entries[(unsigned char)c] = -2;
+            }
+        }
+        int8_t entries[256];
+    } table;
+    return table.entries;
+}
+
+static void EncodeBase64Into(luaL_Buffer* b, const unsigned char* in, size_t len)
+{
+    const uint16_t* pairs = BuildCodeEncodeTable();
+    size_t i = 0;
+    while (len - i >= 3) {
+        // Fill a whole Lua buffer chunk at a time
+        char* out = luaL_prepbuffer(b);
+        size_t groups = std::min((len - i) / 3, (size_t)LUAL_BUFFERSIZE / 4);
+        for (size_t g = 0; g < groups; g++, i += 3, out += 4) {
+            uint32_t v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+            memcpy(out, &pairs[v >> 12], 2);
+            memcpy(out + 2, &pairs[v & 0xfff], 2);
+        }
+        luaL_addsize(b, groups * 4);
+    }
+    if (i < len) {
+        uint32_t v = in[i] << 16;
+        if (i + 1 < len) {
+            v |= in[i + 1] << 8;
+        }
+        luaL_addchar(b, BUILD_CODE_ALPHABET[v >> 18]);
+        luaL_addchar(b, BUILD_CODE_ALPHABET[(v >> 12) & 63]);
+        luaL_addchar(b, i + 1 < len ? BUILD_CODE_ALPHABET[(v >> 6) & 63] : '=');
+        luaL_addchar(b, '=');
+    }
+}
+
+// Returns false on a character outside both alphabets; stops at the first '='
+static bool DecodeBase64(const char* in, size_t len, QByteArray& out)
+{
+    const int8_t* sextets = BuildCodeDecodeTable();
+    out.resize((int)(len / 4 * 3 + 3));
+    char* dst = out.data();
+    uint32_t acc = 0;
+    int count = 0;
+    for (size_t i = 0; i < len && in[i] != '='; i++) {
+        int8_t s = sextets[(unsigned char)in[i]];
+        if (s < 0) {
+            if (s == -2) {
+                continue;
+            }
+            return false;
+        }
+        acc = (acc << 6) | s;
+        if (++count == 4) {
+            *dst++ = (char)(acc >> 16);
+            *dst++ = (char)(acc >> 8);
+            *dst++ = (char)acc;
+            acc = 0;
+            count = 0;
+        }
+    }
+    if (count == 1) {
+        return false;
+    } else if (count == 2) {
+        *dst++ = (char)(acc >> 4);
+    } else if (count == 3) {
+        *dst++ = (char)(acc >> 10);
+        *dst++ = (char)(acc >> 2);
+    }
+    out.resize((int)(dst - out.constData()));
+    return true;
+}
+
+static int l_EncodeBuildCode(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1) {
+        return luaL_error(L, "Usage: EncodeBuildCode(xml)");
+    }
+    size_t inLen;
+    const char* in = CheckCompressInput(L, 1, "EncodeBuildCode", &inLen);
+    z_stream* z = ThreadZStreams().deflateStream(9);
+    if (!z) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    QByteArray compressed;
+    compressed.resize((int)deflateBound(z, (uLong)inLen));
+    z->next_in = (Bytef*)in;
+    z->avail_in = (uInt)inLen;
+    z->next_out = (Bytef*)compressed.data();
+    z->avail_out = (uInt)compressed.size();
+    int err = deflate(z, Z_FINISH);
+    if (err != Z_STREAM_END) {
+        return PushZError(L, err == Z_OK ? Z_BUF_ERROR : err);
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    EncodeBase64Into(&b, (const unsigned char*)compressed.constData(), z->total_out);
+    luaL_pushresult(&b);
+    return 1;
+}
+
+static int l_DecodeBuildCode(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1) {
+        return luaL_error(L, "Usage: DecodeBuildCode(code)");
+    }
+    size_t codeLen;
+    const char* code = CheckCompressInput(L, 1, "DecodeBuildCode", &codeLen);
+    QByteArray compressed;
+    if (!DecodeBase64(code, codeLen, compressed)) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "invalid character in build code");
+        return 2;
+    }
+    z_stream* z = ThreadZStreams().inflateStream();
+    if (!z) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    z->next_in = (Bytef*)compressed.constData();
+    z->avail_in = (uInt)compressed.size();
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int err = InflateInto(&b, z);
+    luaL_pushresult(&b);
+    if (err != Z_STREAM_END) {
+        // A truncated code stops with Z_OK or Z_BUF_ERROR depending on where the input ran out
+        return PushZError(L, err == Z_OK || err == Z_BUF_ERROR ? Z_DATA_ERROR : err);
+    }
+    return 1;
+}
+
+static void RegisterBuildCode(lua_State* L)
+{
+    lua_pushcfunction(L, l_EncodeBuildCode);
+    lua_setglobal(L, "EncodeBuildCode");
+    lua_pushcfunction(L, l_DecodeBuildCode);
+    lua_setglobal(L, "DecodeBuildCode");
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef BUILDINDEX_HPP
+#define BUILDINDEX_HPP
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QObject>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QSocketNotifier>
+#include <QString>
+#include <QStringList>
+#include <QThreadPool>
+#include <QTimer>
+
+#ifdef Q_OS_LINUX
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "xmlparser.hpp"
+
+// Persistent index of the .xml files under a builds folder. The last saved index is served
+// immediately; a background rescan then brings it up to date, re-reading only files whose size
+// or mtime changed, and the folder is watched (inotify on Linux) so later changes trigger
+// another rescan. Optionally keeps the attributes of the first headerElem element of each file.
+class BuildIndex : public QObject {
+    Q_OBJECT
+public:
+    struct Entry {
+        qint64 size;
+        qint64 modified;
+        QHash<QString, QString> header;
+    };
+
+    BuildIndex(const QString& Dir, const QString& HeaderElem, const QString& CacheDir) :
+            generation(0), dir(QDir(Dir).absolutePath()), headerElem(HeaderElem.toUtf8()), scanning(false), rescanPending(false) {
+        if (!CacheDir.isEmpty()) {
+            QDir().mkpath(CacheDir);
+            QByteArray key = (dir + "\n" + HeaderElem).toUtf8();
+            cacheFile = QDir(CacheDir).filePath(QString::fromLatin1(QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex()) + ".idx");
+        }
+        load();
+        scanPool.setMaxThreadCount(1);
+        connect(this, &BuildIndex::scanFinished, this, &BuildIndex::applyScan);
+        rescanTimer.setSingleShot(true);
+        rescanTimer.setInterval(200);
+        connect(&rescanTimer, &QTimer::timeout, this, &BuildIndex::rescan);
+        saveTimer.setSingleShot(true);
+        saveTimer.setInterval(1000);
+        connect(&saveTimer, &QTimer::timeout, this, &BuildIndex::save);
+#ifdef Q_OS_LINUX
+        inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotifyFd >= 0) {
+            notifier = new QSocketNotifier(inotifyFd, QSocketNotifier::Read, this);
+            // activated() is overloaded from Qt 5.15 on, so the member pointer form is ambiguous
+            connect(notifier, SIGNAL(activated(int)), this, SLOT(readInotify()));
+        }
+#endif
+        rescan();
+    }
+
+    ~BuildIndex() {
+        scanPool.waitForDone();
+        if (saveTimer.isActive()) {
+            save();
+        }
+#ifdef Q_OS_LINUX
+        if (inotifyFd >= 0) {
+            close(inotifyFd);
+        }
+#endif
+    }
+
+    // Keyed by path relative to the indexed folder, using '/' separators
+    const QMap<QString, Entry>& entries() const {
+        return files;
+    }
+
+    const QStringList& folders() const {
+        return subFolders;
+    }
+
+    // Bumped whenever the index changes, so scripts can tell when to rebuild their lists
+    int generation;
+
+public slots:
+    // Starts a background rescan, or queues one if a scan is already running
+    void rescan() {
+        if (scanning) {
+            rescanPending = true;
+            return;
+        }
+        scanning = true;
+        scanPool.start(new Scan(this, files));
+    }
+
+signals:
+    void scanFinished();
+
+private slots:
+    void applyScan() {
+        QMap<QString, Entry> scannedFiles;
+        QStringList scannedFolders;
+        {
+            QMutexLocker lock(&mutex);
+            scannedFiles.swap(result);
+            scannedFolders.swap(resultFolders);
+        }
+        scanning = false;
+        watch(scannedFolders);
+        if (!sameFiles(scannedFiles) || scannedFolders != subFolders) {
+            files.swap(scannedFiles);
+            subFolders = scannedFolders;
+            generation++;
+            saveTimer.start();
+        }
+        if (rescanPending) {
+            rescanPending = false;
+            rescan();
+        }
+    }
+
+    void readInotify() {
+#ifdef Q_OS_LINUX
+        char buf[4096];
+        while (read(inotifyFd, buf, sizeof(buf)) > 0) {
+        }
+#endif
+        rescanTimer.start();
+    }
+
+private:
+    class Scan : public QRunnable {
+    public:
+        Scan(BuildIndex* Index, const QMap<QString, Entry>& Previous) : index(Index), previous(Previous) {}
+
+        void run() override {
+            QDir root(index->dir);
+            QMap<QString, Entry> scanned;
+            QStringList folders;
+            QDirIterator it(index->dir, QStringList() << "*.xml", QDir::Files | QDir::AllDirs | QDir::NoDotAndDotDot, QDirIterator::Subdirectories);
+            while (it.hasNext()) {
+                it.next();
+                QFileInfo info = it.fileInfo();
+                QString name = root.relativeFilePath(it.filePath());
+                if (info.isDir()) {
+                    folders << name;
+                    continue;
+                }
+                Entry entry{info.size(), info.lastModified().toMSecsSinceEpoch(), QHash<QString, QString>()};
+                auto old = previous.constFind(name);
+                if (old != previous.constEnd() && old->size == entry.size && old->modified == entry.modified) {
+                    entry.header = old->header;
+                } else if (!index->headerElem.isEmpty()) {
+                    readHeader(it.filePath(), entry.header);
+                }
+                scanned.insert(name, entry);
+            }
+            folders.sort();
+            {
+                QMutexLocker lock(&index->mutex);
+                index->result.swap(scanned);
+                index->resultFolders.swap(folders);
+            }
+            emit index->scanFinished();
+        }
+
+    private:
+        // The header element is expected near the top, so only the start of the file is read
+        void readHeader(const QString& path, QHash<QString, QString>& header) {
+            QFile file(path);
+            if (!file.open(QFile::ReadOnly)) {
+                return;
+            }
+            QByteArray head = file.read(64 << 10);
+            HeaderSink sink{index->headerElem, &header};
+            XMLParser(head.constData(), head.size()).parse(sink);
+        }
+
+        struct HeaderSink {
+            QByteArray elem;
+            QHash<QString, QString>* header;
+            std::string scratch;
+
+            bool startElement(const char* name, size_t nameLen, const std::vector<XMLAttr>& attrs, bool) {
+                if (nameLen != (size_t)elem.size() || memcmp(name, elem.constData(), nameLen)) {
+                    return true;
+                }
+                for (auto& attr : attrs) {
+                    UnescapeXML(attr.value, attr.valueLen, scratch);
+                    header->insert(QString::fromUtf8(attr.name, (int)attr.nameLen), QString::fromUtf8(scratch.data(), (int)scratch.size()));
+                }
+                return false;
+            }
+            bool endElement(const char*, size_t) {
+                return true;
+            }
+            bool text(const char*, size_t, bool) {
+                return true;
+            }
+        };
+
+        BuildIndex* index;
+        QMap<QString, Entry> previous;
+    };
+
+    bool sameFiles(const QMap<QString, Entry>& other) const {
+        if (other.size() != files.size()) {
+            return false;
+        }
+        for (auto a = files.constBegin(), b = other.constBegin(); a != files.constEnd(); ++a, ++b) {
+            if (a.key() != b.key() || a->size != b->size || a->modified != b->modified || a->header != b->header) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void watch(const QStringList& folders) {
+        QStringList paths;
+        paths << dir;
+        for (const QString& folder : folders) {
+            paths << QDir(dir).filePath(folder);
+        }
+#ifdef Q_OS_LINUX
+        if (inotifyFd >= 0) {
+            // Adding an existing watch just returns its descriptor again
+            for (const QString& path : paths) {
+                inotify_add_watch(inotifyFd, QFile::encodeName(path).constData(),
+                                  IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF);
+            }
+            return;
+        }
+#endif
+        if (!watcher) {
+            watcher = new QFileSystemWatcher(this);
+            connect(watcher, &QFileSystemWatcher::directoryChanged, this, [this]() { rescanTimer.start(); });
+        }
+        QStringList current = watcher->directories();
+        for (const QString& path : paths) {
+            if (!current.contains(path)) {
+                watcher->addPath(path);
+            }
+        }
+    }
+
+    void load() {
+        if (cacheFile.isEmpty()) {
+            return;
+        }
+        QFile file(cacheFile);
+        if (!file.open(QFile::ReadOnly)) {
+            return;
+        }
+        QDataStream in(&file);
+        qint32 version;
+        QString savedDir;
+        in >> version >> savedDir;
+        if (version != 1 || savedDir != dir) {
+            return;
+        }
+        QMap<QString, Entry> loaded;
+        QStringList loadedFolders;
+        qint32 count;
+        in >> loadedFolders >> count;
+        for (qint32 i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+            QString name;
+            Entry entry;
+            in >> name >> entry.size >> entry.modified >> entry.header;
+            loaded.insert(name, entry);
+        }
+        if (in.status() == QDataStream::Ok) {
+            files.swap(loaded);
+            subFolders = loadedFolders;
+        }
+    }
+
+    void save() {
+        if (cacheFile.isEmpty()) {
+            return;
+        }
+        QSaveFile file(cacheFile);
+        if (!file.open(QFile::WriteOnly)) {
+            return;
+        }
+        QDataStream out(&file);
+        out << (qint32)1 << dir << subFolders << (qint32)files.size();
+        for (auto it = files.constBegin(); it != files.constEnd(); ++it) {
+            out << it.key() << it->size << it->modified << it->header;
+        }
+        file.commit();
+    }
+
+    QString dir;
+    QByteArray headerElem;
+    QString cacheFile;
+    QMap<QString, Entry> files;
+    QStringList subFolders;
+    bool scanning;
+    bool rescanPending;
+    QThreadPool scanPool;
+    QTimer rescanTimer;
+    QTimer saveTimer;
+    QMutex mutex;
+    QMap<QString, Entry> result;
+    QStringList resultFolders;
+    QFileSystemWatcher* watcher = nullptr;
+#ifdef Q_OS_LINUX
+    int inotifyFd = -1;
+    QSocketNotifier* notifier = nullptr;
+#endif
+};
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef BYTECODE_HPP
+#define BYTECODE_HPP
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QHash>
+#include <QMutex>
+#include <QString>
+
+#include <atomic>
+
+#include "logger.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+    #include "luajit.h"
+}
+
+// lua_Writer that appends a dumped chunk to a QByteArray
+static int BytecodeWriter(lua_State* L, const void* p, size_t sz, void* ud)
+{
+    ((QByteArray*)ud)->append((const char*)p, (int)sz);
+    return 0;
+}
+
+// Compiled LaunchSubScript/ParallelMap chunks, keyed by a hash of the LuaJIT version and
+// the script text. Shared by every subscript worker; optionally mirrored to a directory on disk.
+class ScriptCache {
+public:
+    ScriptCache() : hits(0), misses(0) {}
+
+    // Loads the script onto L's stack like luaL_loadbuffer, compiling and caching it on a miss.
+    // Cached bytecode that won't load (truncated, or from another LuaJIT) is dropped and rebuilt.
+    int load(lua_State* L, const QByteArray& script) {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(QByteArray::number(LUAJIT_VERSION_NUM) + "\n");
+        hash.addData(script);
+        QByteArray key = hash.result().toHex();
+        QByteArray bytecode;
+        if (find(key, bytecode)) {
+            if (luaL_loadbuffer(L, bytecode.constData(), bytecode.size(), script.constData()) == 0) {
+                hits++;
+                return 0;
+            }
+            lua_pop(L, 1);
+            evict(key);
+            bytecode.clear();
+        }
+        misses++;
+        int err = luaL_loadbuffer(L, script.constData(), script.size(), script.constData());
+        if (err == 0) {
+            lua_dump(L, BytecodeWriter, &bytecode);
+            store(key, bytecode);
+        }
+        return err;
+    }
+
+    void setDir(const QString& path) {
+        QMutexLocker lock(&mutex);
+        dir = path;
+        if (!dir.isEmpty()) {
+            QDir().mkpath(dir);
+        }
+    }
+
+    std::atomic<int> hits;
+    std::atomic<int> misses;
+
+private:
+    bool find(const QByteArray& key, QByteArray& bytecode) {
+        QMutexLocker lock(&mutex);
+        if (entries.contains(key)) {
+            bytecode = entries.value(key);
+            return true;
+        }
+        if (dir.isEmpty()) {
+            return false;
+        }
+        QFile file(QDir(dir).filePath(QString::fromLatin1(key) + ".luac"));
+        if (!file.open(QFile::ReadOnly)) {
+            return false;
+        }
+        bytecode = file.readAll();
+        entries.insert(key, bytecode);
+        return true;
+    }
+
+    void store(const QByteArray& key, const QByteArray& bytecode) {
+        QMutexLocker lock(&mutex);
+        entries.insert(key, bytecode);
+        if (dir.isEmpty()) {
+            return;
+        }
+        // Write to a temporary name first so a concurrent reader never sees half a file
+        QString path = QDir(dir).filePath(QString::fromLatin1(key) + ".luac");
+        QFile file(path + ".tmp");
+        if (!file.open(QFile::WriteOnly | QFile::Truncate)) {
+            LogPrintf("Can't write subscript cache file %s", qPrintable(file.fileName()));
+            return;
+        }
+        bool written = file.write(bytecode) == bytecode.size() && file.flush();
+        file.close();
+        QFile::remove(path);
+        if (!written || !QFile::rename(path + ".tmp", path)) {
+            LogPrintf("Can't write subscript cache file %s", qPrintable(path));
+            QFile::remove(path + ".tmp");
+        }
+    }
+
+    void evict(const QByteArray& key) {
+        QMutexLocker lock(&mutex);
+        entries.remove(key);
+        if (!dir.isEmpty()) {
+            QFile::remove(QDir(dir).filePath(QString::fromLatin1(key) + ".luac"));
+        }
+    }
+
+    QMutex mutex;
+    QHash<QByteArray, QByteArray> entries;
+    QString dir;
+};
+
+#endif
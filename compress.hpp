@@ -0,0 +1,499 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+
+#include <QThread>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "blob.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// ===========
+// Compression
+// ===========
+
+// Deflate() payloads at least this large are split into blocks and compressed on every core
+static const size_t PARALLEL_DEFLATE_MIN = 1 << 20;
+static const size_t PARALLEL_DEFLATE_BLOCK = 128 << 10;
+static const size_t DEFLATE_WINDOW = 32 << 10;
+
+// Runs deflate() until it stops producing output, appending what it writes to a Lua buffer
+static int DeflateInto(luaL_Buffer* b, z_stream* z, int flush)
+{
+    int err;
+    do {
+        z->next_out = (Bytef*)luaL_prepbuffer(b);
+        z->avail_out = LUAL_BUFFERSIZE;
+        err = deflate(z, flush);
+        luaL_addsize(b, LUAL_BUFFERSIZE - z->avail_out);
+    } while (err == Z_OK && z->avail_out == 0);
+    return err;
+}
+
+static int InflateInto(luaL_Buffer* b, z_stream* z)
+{
+    int err;
+    do {
+        z->next_out = (Bytef*)luaL_prepbuffer(b);
+        z->avail_out = LUAL_BUFFERSIZE;
+        err = inflate(z, Z_NO_FLUSH);
+        luaL_addsize(b, LUAL_BUFFERSIZE - z->avail_out);
+    } while (err == Z_OK && z->avail_out == 0);
+    return err;
+}
+
+// One-shot Deflate()/Inflate() keep a stream per thread instead of setting one up on every call
+struct ZStreams {
+    ZStreams() : deflater(), deflateLevel(-2), inflater(), inflaterReady(false) {}
+
+    ~ZStreams() {
+        if (deflateLevel != -2) {
+            deflateEnd(&deflater);
+        }
+        if (inflaterReady) {
+            inflateEnd(&inflater);
+        }
+    }
+
+    z_stream* deflateStream(int level) {
+        if (deflateLevel == level) {
+            deflateReset(&deflater);
+            return &deflater;
+        }
+        if (deflateLevel != -2) {
+            deflateEnd(&deflater);
+            deflateLevel = -2;
+        }
+        if (deflateInit(&deflater, level) != Z_OK) {
+            return nullptr;
+        }
+        deflateLevel = level;
+        return &deflater;
+    }
+
+    z_stream* inflateStream() {
+        if (inflaterReady) {
+            inflateReset(&inflater);
+        } else if (inflateInit(&inflater) == Z_OK) {
+            inflaterReady = true;
+        } else {
+            return nullptr;
+        }
+        return &inflater;
+    }
+
+    z_stream deflater;
+    int deflateLevel;
+    z_stream inflater;
+    bool inflaterReady;
+};
+
+static ZStreams& ThreadZStreams()
+{
+    static thread_local ZStreams streams;
+    return streams;
+}
+
+// Block-parallel deflate that still produces a single zlib stream. Each block is compressed as raw
+// deflate primed with the 32K of input before it, and all but the last end on a byte boundary
+// (Z_SYNC_FLUSH), so the blocks can be concatenated between a zlib header and the combined Adler-32.
+// Returns false without touching the buffer if any block failed.
+static bool ParallelDeflate(luaL_Buffer* b, const Bytef* in, size_t len, int level, int threads)
+{
+    struct Block {
+        QByteArray out;
+        uLong adler;
+        bool ok;
+    };
+    size_t blockCount = (len + PARALLEL_DEFLATE_BLOCK - 1) / PARALLEL_DEFLATE_BLOCK;
+    std::vector<Block> blocks(blockCount);
+    std::atomic<size_t> next(0);
+    auto work = [&]() {
+        z_stream z = {};
+        if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return;
+        }
+        for (size_t i = next++; i < blockCount; i = next++) {
+            size_t start = i * PARALLEL_DEFLATE_BLOCK;
+            size_t size = std::min(PARALLEL_DEFLATE_BLOCK, len - start);
+            Block& block = blocks[i];
+            deflateReset(&z);
+            if (start > 0) {
+                size_t dict = std::min(start, DEFLATE_WINDOW);
+                deflateSetDictionary(&z, in + start - dict, (uInt)dict);
+            }
+            // deflateBound() doesn't cover the empty stored block a sync flush ends with
+            block.out.resize((int)deflateBound(&z, (uLong)size) + 16);
+            z.next_in = (Bytef*)(in + start);
+            z.avail_in = (uInt)size;
+            z.next_out = (Bytef*)block.out.data();
+            z.avail_out = (uInt)block.out.size();
+            int err = deflate(&z, i == blockCount - 1 ? Z_FINISH : Z_SYNC_FLUSH);
+            block.ok = (err == Z_OK || err == Z_STREAM_END) && z.avail_in == 0 && z.avail_out > 0;
+            block.out.resize((int)(block.out.size() - z.avail_out));
+            block.adler = adler32(adler32(0, nullptr, 0), in + start, (uInt)size);
+        }
+        deflateEnd(&z);
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads && (size_t)t < blockCount; t++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& thread : pool) {
+        thread.join();
+    }
+
+    for (auto& block : blocks) {
+        if (!block.ok) {
+            return false;
+        }
+    }
+    int flevel = level == Z_DEFAULT_COMPRESSION || level == 6 ? 2 : level < 2 ? 0 : level < 6 ? 1 : 3;
+    unsigned header = (0x78 << 8) | (flevel << 6);
+    header += 31 - header % 31;
+    luaL_addchar(b, (char)(header >> 8));
+    luaL_addchar(b, (char)(header & 0xff));
+    uLong adler = adler32(0, nullptr, 0);
+    size_t start = 0;
+    for (auto& block : blocks) {
+        size_t size = std::min(PARALLEL_DEFLATE_BLOCK, len - start);
+        luaL_addlstring(b, block.out.constData(), block.out.size());
+        adler = adler32_combine(adler, block.adler, (z_off_t)size);
+        start += size;
+    }
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        luaL_addchar(b, (char)((adler >> shift) & 0xff));
+    }
+    return true;
+}
+
+static const char* CheckCompressInput(lua_State* L, int index, const char* func, size_t* len)
+{
+    if (!lua_isstring(L, index) && !ToBlob(L, index)) {
+        luaL_error(L, "%s() argument %d: expected string or blob, got %s", func, index, luaL_typename(L, index));
+    }
+    return ToBytes(L, index, len);
+}
+
+static int CheckLevel(lua_State* L, int index, const char* func)
+{
+    int level = (int)luaL_optinteger(L, index, 9);
+    if (level < 0 || level > 9) {
+        luaL_error(L, "%s() argument %d: compression level must be between 0 and 9", func, index);
+    }
+    return level;
+}
+
+static int PushZError(lua_State* L, int err)
+{
+    lua_pushnil(L);
+    lua_pushstring(L, zError(err));
+    return 2;
+}
+
+static int l_Deflate(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1) {
+        return luaL_error(L, "Usage: Deflate(string[, level[, threads]])");
+    }
+    size_t inLen;
+    const char* in = CheckCompressInput(L, 1, "Deflate", &inLen);
+    int level = CheckLevel(L, 2, "Deflate");
+    int threads = (int)luaL_optinteger(L, 3, 0);
+    if (threads <= 0) {
+        threads = inLen >= PARALLEL_DEFLATE_MIN ? QThread::idealThreadCount() : 1;
+    }
+    luaL_Buffer b;
+    if (threads > 1 && inLen > PARALLEL_DEFLATE_BLOCK) {
+        luaL_buffinit(L, &b);
+        if (ParallelDeflate(&b, (const Bytef*)in, inLen, level, threads)) {
+            luaL_pushresult(&b);
+            return 1;
+        }
+        // Fall back to a single stream; the buffer is still empty
+        luaL_pushresult(&b);
+        lua_pop(L, 1);
+    }
+    z_stream* z = ThreadZStreams().deflateStream(level);
+    if (!z) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    z->next_in = (Bytef*)in;
+    z->avail_in = (uInt)inLen;
+    luaL_buffinit(L, &b);
+    int err = DeflateInto(&b, z, Z_FINISH);
+    luaL_pushresult(&b);
+    if (err != Z_STREAM_END) {
+        return PushZError(L, err);
+    }
+    return 1;
+}
+
+static int l_Inflate(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1) {
+        return luaL_error(L, "Usage: Inflate(string)");
+    }
+    size_t inLen;
+    const char* in = CheckCompressInput(L, 1, "Inflate", &inLen);
+    z_stream* z = ThreadZStreams().inflateStream();
+    if (!z) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    z->next_in = (Bytef*)in;
+    z->avail_in = (uInt)inLen;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int err = InflateInto(&b, z);
+    luaL_pushresult(&b);
+    if (err != Z_STREAM_END) {
+        // Running out of input before the end of the stream means it was truncated; zlib reports
+        // that as Z_OK or Z_BUF_ERROR depending on where the input stopped
+        return PushZError(L, err == Z_OK || err == Z_BUF_ERROR ? Z_DATA_ERROR : err);
+    }
+    return 1;
+}
+
+// ==================
+// Streaming handles
+// ==================
+
+// The z_stream lives inside the userdata; Lua never moves userdata, so zlib's back pointer stays valid
+struct deflater_s {
+    z_stream z;
+    int level;
+    bool ready;
+    bool finished;
+};
+
+struct inflater_s {
+    z_stream z;
+    bool ready;
+    bool finished;
+};
+
+static int l_NewDeflater(lua_State* L)
+{
+    int level = CheckLevel(L, 1, "NewDeflater");
+    auto deflater = (deflater_s*)lua_newuserdata(L, sizeof(deflater_s));
+    deflater->z = z_stream();
+    deflater->level = level;
+    deflater->finished = false;
+    deflater->ready = deflateInit(&deflater->z, level) == Z_OK;
+    luaL_getmetatable(L, "uideflatermeta");
+    lua_setmetatable(L, -2);
+    if (!deflater->ready) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    return 1;
+}
+
+static deflater_s* GetDeflater(lua_State* L, const char* method)
+{
+    auto deflater = (deflater_s*)luaL_checkudata(L, 1, "uideflatermeta");
+    if (!deflater->ready && strcmp(method, "__gc")) {
+        luaL_error(L, "deflater:%s(): deflater failed to initialise", method);
+    }
+    return deflater;
+}
+
+static int l_deflaterGC(lua_State* L)
+{
+    deflater_s* deflater = GetDeflater(L, "__gc");
+    if (deflater->ready) {
+        deflateEnd(&deflater->z);
+        deflater->ready = false;
+    }
+    return 0;
+}
+
+// Compresses more input; returns whatever compressed bytes are ready (possibly an empty string)
+static int DeflaterRun(lua_State* L, const char* method, int flush)
+{
+    deflater_s* deflater = GetDeflater(L, method);
+    if (deflater->finished) {
+        return luaL_error(L, "deflater:%s(): stream already finished; call Reset() first", method);
+    }
+    size_t inLen = 0;
+    const char* in = "";
+    if (!lua_isnoneornil(L, 2)) {
+        in = CheckCompressInput(L, 2, method, &inLen);
+    }
+    deflater->z.next_in = (Bytef*)in;
+    deflater->z.avail_in = (uInt)inLen;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int err = DeflateInto(&b, &deflater->z, flush);
+    luaL_pushresult(&b);
+    if (flush == Z_FINISH) {
+        deflater->finished = true;
+        if (err != Z_STREAM_END) {
+            return PushZError(L, err);
+        }
+    } else if (err != Z_OK && err != Z_BUF_ERROR) {
+        return PushZError(L, err);
+    }
+    return 1;
+}
+
+static int l_deflaterWrite(lua_State* L)
+{
+    return DeflaterRun(L, "Write", Z_NO_FLUSH);
+}
+
+static int l_deflaterFlush(lua_State* L)
+{
+    return DeflaterRun(L, "Flush", Z_SYNC_FLUSH);
+}
+
+static int l_deflaterFinish(lua_State* L)
+{
+    return DeflaterRun(L, "Finish", Z_FINISH);
+}
+
+static int l_deflaterReset(lua_State* L)
+{
+    deflater_s* deflater = GetDeflater(L, "Reset");
+    int level = lua_isnoneornil(L, 2) ? deflater->level : CheckLevel(L, 2, "deflater:Reset");
+    if (level != deflater->level) {
+        deflateEnd(&deflater->z);
+        deflater->z = z_stream();
+        deflater->ready = deflateInit(&deflater->z, level) == Z_OK;
+        deflater->level = level;
+        if (!deflater->ready) {
+            return luaL_error(L, "deflater:Reset(): %s", zError(Z_MEM_ERROR));
+        }
+    } else {
+        deflateReset(&deflater->z);
+    }
+    deflater->finished = false;
+    return 0;
+}
+
+static int l_NewInflater(lua_State* L)
+{
+    auto inflater = (inflater_s*)lua_newuserdata(L, sizeof(inflater_s));
+    inflater->z = z_stream();
+    inflater->finished = false;
+    inflater->ready = inflateInit(&inflater->z) == Z_OK;
+    luaL_getmetatable(L, "uiinflatermeta");
+    lua_setmetatable(L, -2);
+    if (!inflater->ready) {
+        return PushZError(L, Z_MEM_ERROR);
+    }
+    return 1;
+}
+
+static inflater_s* GetInflater(lua_State* L, const char* method)
+{
+    auto inflater = (inflater_s*)luaL_checkudata(L, 1, "uiinflatermeta");
+    if (!inflater->ready && strcmp(method, "__gc")) {
+        luaL_error(L, "inflater:%s(): inflater failed to initialise", method);
+    }
+    return inflater;
+}
+
+static int l_inflaterGC(lua_State* L)
+{
+    inflater_s* inflater = GetInflater(L, "__gc");
+    if (inflater->ready) {
+        inflateEnd(&inflater->z);
+        inflater->ready = false;
+    }
+    return 0;
+}
+
+// Decompresses more input; returns the bytes produced so far, or nil and a message on corrupt data
+static int l_inflaterWrite(lua_State* L)
+{
+    inflater_s* inflater = GetInflater(L, "Write");
+    size_t inLen;
+    const char* in = CheckCompressInput(L, 2, "inflater:Write", &inLen);
+    if (inflater->finished) {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    inflater->z.next_in = (Bytef*)in;
+    inflater->z.avail_in = (uInt)inLen;
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    int err = InflateInto(&b, &inflater->z);
+    luaL_pushresult(&b);
+    if (err == Z_STREAM_END) {
+        inflater->finished = true;
+    } else if (err != Z_OK && err != Z_BUF_ERROR) {
+        return PushZError(L, err);
+    }
+    return 1;
+}
+
+static int l_inflaterIsFinished(lua_State* L)
+{
+    inflater_s* inflater = GetInflater(L, "IsFinished");
+    lua_pushboolean(L, inflater->finished);
+    return 1;
+}
+
+static int l_inflaterReset(lua_State* L)
+{
+    inflater_s* inflater = GetInflater(L, "Reset");
+    inflateReset(&inflater->z);
+    inflater->finished = false;
+    return 0;
+}
+
+// Registers Deflate()/Inflate() and the streaming handles in a state; used by the main state and every sub script worker
+static void RegisterCompress(lua_State* L)
+{
+    luaL_newmetatable(L, "uideflatermeta");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_deflaterGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_deflaterWrite);
+    lua_setfield(L, -2, "Write");
+    lua_pushcfunction(L, l_deflaterFlush);
+    lua_setfield(L, -2, "Flush");
+    lua_pushcfunction(L, l_deflaterFinish);
+    lua_setfield(L, -2, "Finish");
+    lua_pushcfunction(L, l_deflaterReset);
+    lua_setfield(L, -2, "Reset");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, "uiinflatermeta");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_inflaterGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_inflaterWrite);
+    lua_setfield(L, -2, "Write");
+    lua_pushcfunction(L, l_inflaterIsFinished);
+    lua_setfield(L, -2, "IsFinished");
+    lua_pushcfunction(L, l_inflaterReset);
+    lua_setfield(L, -2, "Reset");
+    lua_pop(L, 1);
+
+    lua_pushcfunction(L, l_Deflate);
+    lua_setglobal(L, "Deflate");
+    lua_pushcfunction(L, l_Inflate);
+    lua_setglobal(L, "Inflate");
+    lua_pushcfunction(L, l_NewDeflater);
+    lua_setglobal(L, "NewDeflater");
+    lua_pushcfunction(L, l_NewInflater);
+    lua_setglobal(L, "NewInflater");
+}
+
+#endif
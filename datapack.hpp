@@ -0,0 +1,631 @@
+#ifndef DATAPACK_HPP
+#define DATAPACK_HPP
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QSaveFile>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <vector>
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// ==========
+// Data packs
+// ==========
+
+// Large read-only data tables, serialized ahead of time with WriteDataPack() and memory-mapped
+// by OpenDataPack(). Nothing is decoded up front: OpenDataPack() returns a proxy for the root
+// table whose __index looks the key up in the mapped file, and whatever it finds is stored in
+// the proxy so later reads are plain table reads. Nested tables come back as proxies in turn,
+// so a session only builds the entries it actually touches. Lua 5.1 has no __pairs or __len
+// for tables, so pairs(), ipairs(), next() and # only see what has been read so far;
+// ExpandDataPack(t) reads in the rest first.
+//
+// File layout, in host byte order with offsets from the start of the file:
+//   header   "POBDATA\0", u32 version, u32 offset of the root table
+//   table    u32 array count, u32 hash count, the array values, then (key, value) pairs sorted by key
+//   value    u32 tag, then a double (number), u32 offset + u32 length (string) or u32 offset (table)
+//   strings  raw bytes; each distinct string is stored once
+// A table reachable along several paths is stored once and read back as one proxy.
+
+enum DataPackTag : quint32 {
+    DATAPACK_FALSE = 1,
+    DATAPACK_TRUE,
+    DATAPACK_NUMBER,
+    DATAPACK_STRING,
+    DATAPACK_TABLE,
+};
+
+static const char DATAPACK_MAGIC[8] = {'P', 'O', 'B', 'D', 'A', 'T', 'A', '\0'};
+static const quint32 DATAPACK_VERSION = 1;
+static const quint32 DATAPACK_HEADER_SIZE = 16;
+static const quint32 DATAPACK_VALUE_SIZE = 12;
+
+struct DataPackValue {
+    quint32 tag;
+    double number;
+    quint32 offset;
+    quint32 length;
+};
+
+struct dataPack_s {
+    QFile* file;
+    const uchar* data;
+    quint32 size;
+
+    quint32 u32(quint32 at) const {
+        quint32 v;
+        memcpy(&v, data + at, 4);
+        return v;
+    }
+
+    // Offsets are checked as they are followed, so a damaged file is reported rather than read past
+    bool value(quint32 at, DataPackValue& v) const {
+        if ((quint64)at + DATAPACK_VALUE_SIZE > size) {
+            return false;
+        }
+        v.tag = u32(at);
+        v.number = 0;
+        v.offset = 0;
+        v.length = 0;
+        if (v.tag == DATAPACK_NUMBER) {
+            memcpy(&v.number, data + at + 4, 8);
+        } else if (v.tag == DATAPACK_STRING || v.tag == DATAPACK_TABLE) {
+            v.offset = u32(at + 4);
+            v.length = u32(at + 8);
+            if (v.tag == DATAPACK_STRING && (quint64)v.offset + v.length > size) {
+                return false;
+            }
+        } else if (v.tag != DATAPACK_FALSE && v.tag != DATAPACK_TRUE) {
+            return false;
+        }
+        return true;
+    }
+
+    bool table(quint32 at, quint32& arrayCount, quint32& hashCount) const {
+        if ((quint64)at + 8 > size) {
+            return false;
+        }
+        arrayCount = u32(at);
+        hashCount = u32(at + 4);
+        return (quint64)at + 8 + (quint64)arrayCount * DATAPACK_VALUE_SIZE + (quint64)hashCount * DATAPACK_VALUE_SIZE * 2 <= size;
+    }
+
+    quint32 arrayEntry(quint32 table, quint32 i) const {
+        return table + 8 + i * DATAPACK_VALUE_SIZE;
+    }
+
+    quint32 hashEntry(quint32 table, quint32 arrayCount, quint32 i) const {
+        return table + 8 + arrayCount * DATAPACK_VALUE_SIZE + i * DATAPACK_VALUE_SIZE * 2;
+    }
+};
+
+// Key order used by the writer's sort and the reader's binary search: false, true, numbers, then strings bytewise
+static int DataPackCompareKeys(quint32 tagA, double numA, const char* strA, size_t lenA,
+                               quint32 tagB, double numB, const char* strB, size_t lenB)
+{
+    if (tagA != tagB) {
+        return tagA < tagB ? -1 : 1;
+    }
+    if (tagA == DATAPACK_NUMBER) {
+        return numA < numB ? -1 : (numA > numB ? 1 : 0);
+    }
+    if (tagA == DATAPACK_STRING) {
+        int c = memcmp(strA, strB, std::min(lenA, lenB));
+        if (c == 0 && lenA != lenB) {
+            c = lenA < lenB ? -1 : 1;
+        }
+        return c;
+    }
+    return 0;
+}
+
+static dataPack_s* ToDataPack(lua_State* L, int index)
+{
+    return (dataPack_s*)luaL_checkudata(L, index, "uidatapackmeta");
+}
+
+static void DataPackCorrupt(lua_State* L)
+{
+    luaL_error(L, "data pack is damaged or truncated");
+}
+
+// Finds the value stored under the key at keyIndex in the table record at tableOffset
+static bool DataPackFind(lua_State* L, const dataPack_s* pack, quint32 tableOffset, int keyIndex, DataPackValue& out)
+{
+    quint32 arrayCount, hashCount;
+    if (!pack->table(tableOffset, arrayCount, hashCount)) {
+        DataPackCorrupt(L);
+    }
+    quint32 tag;
+    double num = 0;
+    const char* str = nullptr;
+    size_t len = 0;
+    switch (lua_type(L, keyIndex)) {
+    case LUA_TBOOLEAN:
+        tag = lua_toboolean(L, keyIndex) ? DATAPACK_TRUE : DATAPACK_FALSE;
+        break;
+    case LUA_TNUMBER:
+        tag = DATAPACK_NUMBER;
+        num = lua_tonumber(L, keyIndex);
+        if (num >= 1 && num <= arrayCount && num == (double)(quint32)num) {
+            if (!pack->value(pack->arrayEntry(tableOffset, (quint32)num - 1), out)) {
+                DataPackCorrupt(L);
+            }
+            return true;
+        }
+        break;
+    case LUA_TSTRING:
+        tag = DATAPACK_STRING;
+        str = lua_tolstring(L, keyIndex, &len);
+        break;
+    default:
+        return false;
+    }
+    quint32 lo = 0, hi = hashCount;
+    while (lo < hi) {
+        quint32 mid = lo + (hi - lo) / 2;
+        quint32 entry = pack->hashEntry(tableOffset, arrayCount, mid);
+        DataPackValue key;
+        if (!pack->value(entry, key) || key.tag == DATAPACK_TABLE) {
+            DataPackCorrupt(L);
+        }
+        int c = DataPackCompareKeys(tag, num, str, len, key.tag, key.number, (const char*)pack->data + key.offset, key.length);
+        if (c == 0) {
+            if (!pack->value(entry + DATAPACK_VALUE_SIZE, out)) {
+                DataPackCorrupt(L);
+            }
+            return true;
+        }
+        if (c < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return false;
+}
+
+// Pushes the proxy for a table record, reusing the one made earlier if there is one.
+// The pack's environment table caches proxies by offset and holds the shared __index function.
+static void DataPackPushProxy(lua_State* L, int packIndex, quint32 offset)
+{
+    lua_getfenv(L, packIndex);
+    lua_rawgeti(L, -1, (int)offset);
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return;
+    }
+    lua_pop(L, 1);
+    lua_newtable(L);	// Proxy
+    lua_createtable(L, 0, 3);	// Its metatable
+    lua_pushvalue(L, packIndex);
+    lua_setfield(L, -2, "pack");
+    lua_pushnumber(L, offset);
+    lua_setfield(L, -2, "record");
+    lua_getfield(L, -3, "index");
+    lua_setfield(L, -2, "__index");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawseti(L, -3, (int)offset);
+    lua_remove(L, -2);
+}
+
+static void DataPackPushValue(lua_State* L, int packIndex, const dataPack_s* pack, const DataPackValue& v)
+{
+    switch (v.tag) {
+    case DATAPACK_FALSE:
+    case DATAPACK_TRUE:
+        lua_pushboolean(L, v.tag == DATAPACK_TRUE);
+        break;
+    case DATAPACK_NUMBER:
+        lua_pushnumber(L, v.number);
+        break;
+    case DATAPACK_STRING:
+        lua_pushlstring(L, (const char*)pack->data + v.offset, v.length);
+        break;
+    case DATAPACK_TABLE:
+        DataPackPushProxy(L, packIndex, v.offset);
+        break;
+    }
+}
+
+// Leaves the pack and record offset behind a proxy on the stack; false for anything else
+static bool DataPackProxyInfo(lua_State* L, int index, quint32& offset)
+{
+    if (!lua_getmetatable(L, index)) {
+        return false;
+    }
+    lua_getfield(L, -1, "record");
+    lua_getfield(L, -2, "pack");
+    if (!lua_isnumber(L, -2) || !lua_isuserdata(L, -1)) {
+        lua_pop(L, 3);
+        return false;
+    }
+    offset = (quint32)lua_tonumber(L, -2);
+    lua_replace(L, -3);
+    lua_pop(L, 1);
+    return true;
+}
+
+// __index for proxies: (proxy, key)
+static int l_dataPackIndex(lua_State* L)
+{
+    quint32 offset;
+    if (!DataPackProxyInfo(L, 1, offset)) {
+        return 0;
+    }
+    int packIndex = lua_gettop(L);
+    dataPack_s* pack = ToDataPack(L, packIndex);
+    DataPackValue v;
+    if (!DataPackFind(L, pack, offset, 2, v)) {
+        return 0;
+    }
+    DataPackPushValue(L, packIndex, pack, v);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, 1);
+    return 1;
+}
+
+static int l_dataPackGC(lua_State* L)
+{
+    dataPack_s* pack = ToDataPack(L, 1);
+    delete pack->file;
+    pack->file = nullptr;
+    return 0;
+}
+
+static int l_OpenDataPack(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1 || !lua_isstring(L, 1)) {
+        return luaL_error(L, "Usage: OpenDataPack(path)");
+    }
+    size_t len;
+    const char* path = lua_tolstring(L, 1, &len);
+    QFile* file = new QFile(QFile::decodeName(QByteArray(path, (int)len)));
+    const char* error = nullptr;
+    const uchar* data = nullptr;
+    if (!file->open(QFile::ReadOnly)) {
+        error = "can't open file";
+    } else if (file->size() < DATAPACK_HEADER_SIZE || file->size() > INT_MAX) {
+        error = "not a data pack";
+    } else if (!(data = file->map(0, file->size()))) {
+        error = "can't map file";
+    } else if (memcmp(data, DATAPACK_MAGIC, sizeof(DATAPACK_MAGIC)) != 0) {
+        error = "not a data pack";
+    }
+    if (error) {
+        delete file;
+        lua_pushnil(L);
+        lua_pushfstring(L, "OpenDataPack(): %s: %s", path, error);
+        return 2;
+    }
+    auto pack = (dataPack_s*)lua_newuserdata(L, sizeof(dataPack_s));
+    new (pack) dataPack_s{file, data, (quint32)file->size()};
+    luaL_getmetatable(L, "uidatapackmeta");
+    lua_setmetatable(L, -2);
+    if (pack->u32(8) != DATAPACK_VERSION) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "OpenDataPack(): %s: unsupported version %d", path, (int)pack->u32(8));
+        return 2;
+    }
+    int packIndex = lua_gettop(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, l_dataPackIndex);
+    lua_setfield(L, -2, "index");
+    lua_setfenv(L, packIndex);
+    DataPackPushProxy(L, packIndex, pack->u32(12));
+    return 1;
+}
+
+// Reads every entry the proxy at index hasn't materialized yet, then makes it a plain table
+static void DataPackExpand(lua_State* L, int index, bool recursive)
+{
+    index = index < 0 ? lua_gettop(L) + index + 1 : index;
+    luaL_checkstack(L, 8, "ExpandDataPack(): tables nested too deeply");
+    quint32 offset;
+    if (!DataPackProxyInfo(L, index, offset)) {
+        return;
+    }
+    int packIndex = lua_gettop(L);
+    dataPack_s* pack = ToDataPack(L, packIndex);
+    lua_pushnil(L);
+    lua_setmetatable(L, index);
+    quint32 arrayCount, hashCount;
+    if (!pack->table(offset, arrayCount, hashCount)) {
+        DataPackCorrupt(L);
+    }
+    DataPackValue key, v;
+    for (quint32 i = 0; i < arrayCount + hashCount; i++) {
+        quint32 entry;
+        if (i < arrayCount) {
+            entry = pack->arrayEntry(offset, i);
+            lua_pushnumber(L, i + 1);
+        } else {
+            entry = pack->hashEntry(offset, arrayCount, i - arrayCount);
+            if (!pack->value(entry, key) || key.tag == DATAPACK_TABLE) {
+                DataPackCorrupt(L);
+            }
+            DataPackPushValue(L, packIndex, pack, key);
+            entry += DATAPACK_VALUE_SIZE;
+        }
+        lua_pushvalue(L, -1);
+        lua_rawget(L, index);
+        if (lua_isnil(L, -1)) {
+            // Not read yet; values already there, including ones the script replaced, are kept
+            lua_pop(L, 1);
+            if (!pack->value(entry, v)) {
+                DataPackCorrupt(L);
+            }
+            DataPackPushValue(L, packIndex, pack, v);
+            lua_pushvalue(L, -2);
+            lua_pushvalue(L, -2);
+            lua_rawset(L, index);
+        }
+        if (recursive && lua_istable(L, -1)) {
+            DataPackExpand(L, -1, true);
+        }
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+}
+
+static int l_ExpandDataPack(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1 || !lua_istable(L, 1)) {
+        return luaL_error(L, "Usage: ExpandDataPack(table[, recursive])");
+    }
+    DataPackExpand(L, 1, lua_toboolean(L, 2) != 0);
+    lua_settop(L, 1);
+    return 1;
+}
+
+// Serializes a table of booleans, numbers, strings and tables (keyed by booleans, numbers or strings)
+class DataPackWriter {
+public:
+    explicit DataPackWriter(lua_State* State) : L(State) {}
+
+    // Expects the root table on top of the stack; leaves the stack as it found it
+    QByteArray write() {
+        int root = lua_gettop(L);
+        lua_newtable(L);	// Table -> index in list
+        seen = lua_gettop(L);
+        lua_newtable(L);	// Tables in the order they are written
+        list = lua_gettop(L);
+        add(root);
+        for (int i = 1; i <= (int)tables.size(); i++) {
+            lua_rawgeti(L, list, i);
+            scan(lua_gettop(L), i - 1);
+            lua_pop(L, 1);
+        }
+        quint64 end = DATAPACK_HEADER_SIZE;
+        for (TableInfo& info : tables) {
+            info.offset = (quint32)end;
+            end += 8 + (quint64)info.arrayCount * DATAPACK_VALUE_SIZE + (quint64)info.hashCount * DATAPACK_VALUE_SIZE * 2;
+        }
+        stringsBase = end;
+        if (stringsBase > INT_MAX) {
+            luaL_error(L, "WriteDataPack(): data too large");
+        }
+        QByteArray out;
+        out.reserve((int)end);
+        out.append(DATAPACK_MAGIC, sizeof(DATAPACK_MAGIC));
+        appendU32(out, DATAPACK_VERSION);
+        appendU32(out, tables[0].offset);
+        for (int i = 1; i <= (int)tables.size(); i++) {
+            lua_rawgeti(L, list, i);
+            writeTable(out, lua_gettop(L), tables[i - 1]);
+            lua_pop(L, 1);
+        }
+        if (stringsBase + strings.size() > INT_MAX) {
+            luaL_error(L, "WriteDataPack(): data too large");
+        }
+        out.append(strings);
+        lua_pop(L, 2);
+        return out;
+    }
+
+private:
+    struct TableInfo {
+        quint32 arrayCount;
+        quint32 hashCount;
+        quint32 offset;
+    };
+
+    struct HashEntry {
+        DataPackValue key;
+        QByteArray keyBytes;
+        DataPackValue value;
+    };
+
+    void add(int index) {
+        tables.push_back(TableInfo{0, 0, 0});
+        lua_pushvalue(L, index);
+        lua_rawseti(L, list, (int)tables.size());
+        lua_pushvalue(L, index);
+        lua_pushinteger(L, (lua_Integer)tables.size());
+        lua_rawset(L, seen);
+    }
+
+    void scan(int t, size_t i) {
+        quint32 arrayCount = 0;
+        for (;;) {
+            lua_rawgeti(L, t, arrayCount + 1);
+            bool present = !lua_isnil(L, -1);
+            lua_pop(L, 1);
+            if (!present) {
+                break;
+            }
+            arrayCount++;
+        }
+        quint32 total = 0;
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            int keyType = lua_type(L, -2);
+            if (keyType != LUA_TSTRING && keyType != LUA_TNUMBER && keyType != LUA_TBOOLEAN) {
+                luaL_error(L, "WriteDataPack(): can't store a %s key", luaL_typename(L, -2));
+            }
+            int valueType = lua_type(L, -1);
+            if (valueType == LUA_TTABLE) {
+                lua_pushvalue(L, -1);
+                lua_rawget(L, seen);
+                bool known = !lua_isnil(L, -1);
+                lua_pop(L, 1);
+                if (!known) {
+                    add(lua_gettop(L));
+                }
+            } else if (valueType != LUA_TSTRING && valueType != LUA_TNUMBER && valueType != LUA_TBOOLEAN) {
+                luaL_error(L, "WriteDataPack(): can't store a %s value", luaL_typename(L, -1));
+            }
+            lua_pop(L, 1);
+            total++;
+        }
+        // Not held as a reference across the loop: add() may have grown the vector
+        tables[i].arrayCount = arrayCount;
+        tables[i].hashCount = total - arrayCount;
+    }
+
+    void writeTable(QByteArray& out, int t, const TableInfo& info) {
+        appendU32(out, info.arrayCount);
+        appendU32(out, info.hashCount);
+        for (quint32 i = 1; i <= info.arrayCount; i++) {
+            lua_rawgeti(L, t, i);
+            appendValue(out, encode(-1));
+            lua_pop(L, 1);
+        }
+        std::vector<HashEntry> entries;
+        entries.reserve(info.hashCount);
+        lua_pushnil(L);
+        while (lua_next(L, t)) {
+            if (lua_type(L, -2) == LUA_TNUMBER) {
+                lua_Number k = lua_tonumber(L, -2);
+                if (k >= 1 && k <= info.arrayCount && k == (double)(quint32)k) {
+                    lua_pop(L, 1);
+                    continue;
+                }
+            }
+            HashEntry entry;
+            entry.key = encode(-2);
+            if (entry.key.tag == DATAPACK_STRING) {
+                size_t len;
+                const char* str = lua_tolstring(L, -2, &len);
+                entry.keyBytes = QByteArray(str, (int)len);
+            }
+            entry.value = encode(-1);
+            entries.push_back(entry);
+            lua_pop(L, 1);
+        }
+        std::sort(entries.begin(), entries.end(), [](const HashEntry& a, const HashEntry& b) {
+            return DataPackCompareKeys(a.key.tag, a.key.number, a.keyBytes.constData(), a.keyBytes.size(),
+                                       b.key.tag, b.key.number, b.keyBytes.constData(), b.keyBytes.size()) < 0;
+        });
+        for (const HashEntry& entry : entries) {
+            appendValue(out, entry.key);
+            appendValue(out, entry.value);
+        }
+    }
+
+    DataPackValue encode(int index) {
+        DataPackValue v{0, 0, 0, 0};
+        switch (lua_type(L, index)) {
+        case LUA_TBOOLEAN:
+            v.tag = lua_toboolean(L, index) ? DATAPACK_TRUE : DATAPACK_FALSE;
+            break;
+        case LUA_TNUMBER:
+            v.tag = DATAPACK_NUMBER;
+            v.number = lua_tonumber(L, index);
+            break;
+        case LUA_TSTRING: {
+            v.tag = DATAPACK_STRING;
+            size_t len;
+            const char* str = lua_tolstring(L, index, &len);
+            v.offset = stringOffsets.value(QByteArray::fromRawData(str, (int)len), UINT_MAX);
+            if (v.offset == UINT_MAX) {
+                v.offset = (quint32)(stringsBase + strings.size());
+                stringOffsets.insert(QByteArray(str, (int)len), v.offset);
+                strings.append(str, (int)len);
+            }
+            v.length = (quint32)len;
+            break;
+        }
+        case LUA_TTABLE:
+            v.tag = DATAPACK_TABLE;
+            lua_pushvalue(L, index);
+            lua_rawget(L, seen);
+            v.offset = tables[lua_tointeger(L, -1) - 1].offset;
+            lua_pop(L, 1);
+            break;
+        }
+        return v;
+    }
+
+    static void appendU32(QByteArray& out, quint32 v) {
+        out.append((const char*)&v, 4);
+    }
+
+    static void appendValue(QByteArray& out, const DataPackValue& v) {
+        appendU32(out, v.tag);
+        if (v.tag == DATAPACK_NUMBER) {
+            out.append((const char*)&v.number, 8);
+        } else {
+            appendU32(out, v.offset);
+            appendU32(out, v.length);
+        }
+    }
+
+    lua_State* L;
+    int seen;
+    int list;
+    std::vector<TableInfo> tables;
+    quint64 stringsBase;
+    QHash<QByteArray, quint32> stringOffsets;
+    QByteArray strings;
+};
+
+static int l_WriteDataPack(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 2 || !lua_isstring(L, 1) || !lua_istable(L, 2)) {
+        return luaL_error(L, "Usage: WriteDataPack(path, table)");
+    }
+    lua_settop(L, 2);
+    QByteArray pack = DataPackWriter(L).write();
+    size_t len;
+    const char* path = lua_tolstring(L, 1, &len);
+    QSaveFile file(QFile::decodeName(QByteArray(path, (int)len)));
+    if (!file.open(QFile::WriteOnly) || file.write(pack) != pack.size() || !file.commit()) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "WriteDataPack(): can't write %s", path);
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+// Registers OpenDataPack(), ExpandDataPack() and WriteDataPack() in a state; used by the main state and every sub script worker
+static void RegisterDataPack(lua_State* L)
+{
+    luaL_newmetatable(L, "uidatapackmeta");
+    lua_pushcfunction(L, l_dataPackGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+    lua_pushcfunction(L, l_OpenDataPack);
+    lua_setglobal(L, "OpenDataPack");
+    lua_pushcfunction(L, l_ExpandDataPack);
+    lua_setglobal(L, "ExpandDataPack");
+    lua_pushcfunction(L, l_WriteDataPack);
+    lua_setglobal(L, "WriteDataPack");
+}
+
+#endif
@@ -0,0 +1,133 @@
+#ifndef DRAWLIST_HPP
+#define DRAWLIST_HPP
+
+#include <QOpenGLBuffer>
+#include <QOpenGLTexture>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Textured, coloured quads captured from draw commands while a draw list is recording. They
+// are kept in one vertex buffer and drawn in runs that share a texture, so replaying the list
+// costs a draw call per texture change instead of a command per quad. The vertices move to a
+// static GPU buffer on the first draw and the CPU copy is dropped. A list is recorded once;
+// re-recording or invalidating from Lua swaps in a new one.
+class DrawList {
+public:
+    struct Vertex {
+        float x, y;
+        float s, t;
+        GLubyte color[4];
+    };
+
+    DrawList() : complete(true), recorded(false), vertexCount(0), buffer(QOpenGLBuffer::VertexBuffer) {
+        const float white[4] = {1.0f, 1.0f, 1.0f, 1.0f};
+        setColor(white);
+    }
+
+    ~DrawList() {
+        buffer.destroy();
+    }
+
+    void setColor(const float col[4]) {
+        for (int i = 0; i < 4; i++) {
+            color[i] = colorByte(col[i]);
+        }
+    }
+
+    // Corners in drawing order; col overrides the current colour for this quad
+    void addQuad(const std::shared_ptr<QOpenGLTexture>& tex, const float x[4], const float y[4], const float s[4], const float t[4], const float* col = nullptr) {
+        GLubyte quadColor[4] = {color[0], color[1], color[2], color[3]};
+        if (col) {
+            for (int i = 0; i < 4; i++) {
+                quadColor[i] = colorByte(col[i]);
+            }
+        }
+        if (runs.empty() || runs.back().tex != tex) {
+            runs.push_back({tex, (int)vertices.size(), 0});
+        }
+        for (int v = 0; v < 4; v++) {
+            vertices.push_back({x[v], y[v], s[v], t[v], {quadColor[0], quadColor[1], quadColor[2], quadColor[3]}});
+        }
+        runs.back().count += 4;
+    }
+
+    // Draws with the list's origin at (offsetX, offsetY), scaled; quads without a texture use white.
+    // The current colour is left as it was.
+    void draw(float offsetX, float offsetY, float scale, QOpenGLTexture* white) {
+        if (!upload()) {
+            return;
+        }
+        float curCol[4];
+        glGetFloatv(GL_CURRENT_COLOR, curCol);
+        glPushMatrix();
+        glTranslatef(offsetX, offsetY, 0);
+        glScalef(scale, scale, 1);
+        buffer.bind();
+        glEnableClientState(GL_VERTEX_ARRAY);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glEnableClientState(GL_COLOR_ARRAY);
+        glVertexPointer(2, GL_FLOAT, sizeof(Vertex), (const void*)offsetof(Vertex, x));
+        glTexCoordPointer(2, GL_FLOAT, sizeof(Vertex), (const void*)offsetof(Vertex, s));
+        glColorPointer(4, GL_UNSIGNED_BYTE, sizeof(Vertex), (const void*)offsetof(Vertex, color));
+        for (const Run& run : runs) {
+            if (run.tex && run.tex->isCreated()) {
+                run.tex->bind();
+            } else {
+                white->bind();
+            }
+            glDrawArrays(GL_QUADS, run.first, run.count);
+        }
+        glDisableClientState(GL_COLOR_ARRAY);
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisableClientState(GL_VERTEX_ARRAY);
+        buffer.release();
+        glPopMatrix();
+        glColor4fv(curCol);
+    }
+
+    int quadCount() const {
+        return (vertexCount ? vertexCount : (int)vertices.size()) / 4;
+    }
+
+    // Cleared when something drawn during recording had to be left out, such as an image still loading
+    bool complete;
+    bool recorded;
+
+private:
+    struct Run {
+        std::shared_ptr<QOpenGLTexture> tex;
+        int first;
+        int count;
+    };
+
+    static GLubyte colorByte(float c) {
+        return (GLubyte)(std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+    bool upload() {
+        if (buffer.isCreated()) {
+            return true;
+        }
+        if (vertices.empty() || !buffer.create()) {
+            return false;
+        }
+        buffer.bind();
+        buffer.setUsagePattern(QOpenGLBuffer::StaticDraw);
+        buffer.allocate(vertices.data(), (int)(vertices.size() * sizeof(Vertex)));
+        buffer.release();
+        vertexCount = (int)vertices.size();
+        std::vector<Vertex>().swap(vertices);
+        return true;
+    }
+
+    GLubyte color[4];
+    std::vector<Vertex> vertices;
+    std::vector<Run> runs;
+    int vertexCount;
+    QOpenGLBuffer buffer;
+};
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef GCSCHEDULER_HPP
+#define GCSCHEDULER_HPP
+
+#include <QElapsedTimer>
+#include <QObject>
+#include <QTimer>
+
+#include <algorithm>
+
+extern "C" {
+    #include "lua.h"
+}
+
+// Takes the collector's pacing away from allocation debt, which tends to trigger it in the
+// middle of OnFrame. The automatic collector is stopped and the heap is instead walked in
+// short incremental slices: whatever is left of the frame budget after each frame, and
+// while the event loop is idle. A full collection follows each completed sub script, since
+// their results tend to leave a lot of garbage behind. If the heap still grows too far
+// past its last collected size, slices are taken whether the frame has time or not, and a
+// count hook does the same in the middle of long-running Lua calls (the main state runs
+// with the JIT off, so the hook fires reliably). Only one scheduler can be running.
+class GCScheduler {
+public:
+    static const int BUCKET_COUNT = 10;
+
+    GCScheduler() : L(nullptr), enabled(false), collecting(false), baselineKB(0), steps(0), slices(0), fullCollections(0), totalPauseUs(0), maxPauseUs(0) {
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            pauseHistogram[i] = 0;
+        }
+        idleTimer.setInterval(0);
+        QObject::connect(&idleTimer, &QTimer::timeout, [this]() {
+            idleSlice();
+        });
+    }
+
+    void start(lua_State* LState) {
+        L = LState;
+        setEnabled(true);
+    }
+
+    void setEnabled(bool enable) {
+        if (!L || enable == enabled) {
+            return;
+        }
+        enabled = enable;
+        if (enabled) {
+            lua_gc(L, LUA_GCSTOP, 0);
+            baselineKB = lua_gc(L, LUA_GCCOUNT, 0);
+            running() = this;
+            lua_sethook(L, Hook, LUA_MASKCOUNT, HOOK_INSTRUCTIONS);
+        } else {
+            idleTimer.stop();
+            lua_sethook(L, nullptr, 0, 0);
+            running() = nullptr;
+            lua_gc(L, LUA_GCRESTART, 0);
+        }
+    }
+
+    // Called at the end of paintGL() with the time the frame took
+    void afterFrame(qint64 frameMs) {
+        if (!enabled) {
+            return;
+        }
+        int kb = lua_gc(L, LUA_GCCOUNT, 0);
+        if (!collecting && kb > baselineKB + std::max(baselineKB / 2, 4096)) {
+            collecting = true;
+        }
+        if (!collecting) {
+            return;
+        }
+        qint64 budgetUs = (FRAME_BUDGET_MS - frameMs) * 1000;
+        if (overCeiling(kb)) {
+            // Falling behind the allocation rate; pay some time even if the frame is already late
+            budgetUs = std::max(budgetUs, (qint64)FORCED_SLICE_US);
+        }
+        if (budgetUs > 0) {
+            slice(std::min(budgetUs, (qint64)FRAME_SLICE_US));
+        }
+        if (collecting) {
+            idleTimer.start();
+        }
+    }
+
+    // Called once sub script results have been handed to Lua
+    void fullCollect() {
+        if (!enabled) {
+            return;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        lua_gc(L, LUA_GCCOLLECT, 0);
+        lua_gc(L, LUA_GCSTOP, 0);
+        fullCollections++;
+        record(timer.nsecsElapsed() / 1000);
+        finishCycle();
+    }
+
+    // Pushes { enabled, memoryKB, steps, slices, fullCollections, totalPauseMs, maxPauseMs,
+    // histogram = { { upToMs, count }, ... } }, the last bucket having no upper bound
+    void push(lua_State* LState) {
+        lua_createtable(LState, 0, 8);
+        lua_pushboolean(LState, enabled);
+        lua_setfield(LState, -2, "enabled");
+        lua_pushinteger(LState, L ? lua_gc(L, LUA_GCCOUNT, 0) : 0);
+        lua_setfield(LState, -2, "memoryKB");
+        lua_pushnumber(LState, (lua_Number)steps);
+        lua_setfield(LState, -2, "steps");
+        lua_pushnumber(LState, (lua_Number)slices);
+        lua_setfield(LState, -2, "slices");
+        lua_pushnumber(LState, (lua_Number)fullCollections);
+        lua_setfield(LState, -2, "fullCollections");
+        lua_pushnumber(LState, totalPauseUs / 1000.0);
+        lua_setfield(LState, -2, "totalPauseMs");
+        lua_pushnumber(LState, maxPauseUs / 1000.0);
+        lua_setfield(LState, -2, "maxPauseMs");
+        lua_createtable(LState, BUCKET_COUNT, 0);
+        for (int i = 0; i < BUCKET_COUNT; i++) {
+            lua_createtable(LState, 0, 2);
+            if (i < BUCKET_COUNT - 1) {
+                lua_pushnumber(LState, bucketLimitUs(i) / 1000.0);
+                lua_setfield(LState, -2, "upToMs");
+            }
+            lua_pushnumber(LState, (lua_Number)pauseHistogram[i]);
+            lua_setfield(LState, -2, "count");
+            lua_rawseti(LState, -2, i + 1);
+        }
+        lua_setfield(LState, -2, "histogram");
+    }
+
+private:
+    static const int FRAME_BUDGET_MS = 16;
+    static const int FRAME_SLICE_US = 2000;
+    static const int FORCED_SLICE_US = 1000;
+    static const int IDLE_SLICE_US = 1000;
+    static const int HOOK_INSTRUCTIONS = 1000000;
+
+    static GCScheduler*& running() {
+        static GCScheduler* scheduler = nullptr;
+        return scheduler;
+    }
+
+    static void Hook(lua_State* L, lua_Debug*) {
+        GCScheduler* scheduler = running();
+        // Coroutines inherit the hook, so L may be any thread of the main state
+        if (scheduler && scheduler->overCeiling(lua_gc(L, LUA_GCCOUNT, 0))) {
+            scheduler->collecting = true;
+            scheduler->slice(FORCED_SLICE_US);
+        }
+    }
+
+    bool overCeiling(int kb) const {
+        return kb > baselineKB * 3 + 16384;
+    }
+
+    // 0.1ms, 0.25ms, 0.5ms, 1ms ... 32ms, then everything longer
+    static qint64 bucketLimitUs(int bucket) {
+        static const qint64 limits[BUCKET_COUNT - 1] = {100, 250, 500, 1000, 2000, 4000, 8000, 16000, 32000};
+        return limits[bucket];
+    }
+
+    void record(qint64 us) {
+        int bucket = 0;
+        while (bucket < BUCKET_COUNT - 1 && us > bucketLimitUs(bucket)) {
+            bucket++;
+        }
+        pauseHistogram[bucket]++;
+        totalPauseUs += us;
+        maxPauseUs = std::max(maxPauseUs, us);
+    }
+
+    // Runs incremental steps for roughly budgetUs, stopping early if the cycle completes
+    void slice(qint64 budgetUs) {
+        QElapsedTimer timer;
+        timer.start();
+        bool finished = false;
+        do {
+            finished = lua_gc(L, LUA_GCSTEP, 0) != 0;
+            steps++;
+        } while (!finished && timer.nsecsElapsed() / 1000 < budgetUs);
+        // Stepping resets the collector's threshold, which would let it run on its own again
+        lua_gc(L, LUA_GCSTOP, 0);
+        slices++;
+        record(timer.nsecsElapsed() / 1000);
+        if (finished) {
+            finishCycle();
+        }
+    }
+
+    void idleSlice() {
+        if (!enabled || !collecting) {
+            idleTimer.stop();
+            return;
+        }
+        slice(IDLE_SLICE_US);
+    }
+
+    void finishCycle() {
+        collecting = false;
+        baselineKB = lua_gc(L, LUA_GCCOUNT, 0);
+        idleTimer.stop();
+    }
+
+    lua_State* L;
+    bool enabled;
+    bool collecting;
+    int baselineKB;
+    quint64 steps;
+    quint64 slices;
+    quint64 fullCollections;
+    qint64 totalPauseUs;
+    qint64 maxPauseUs;
+    quint64 pauseHistogram[BUCKET_COUNT];
+    QTimer idleTimer;
+};
+
+#endif
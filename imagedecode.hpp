@@ -0,0 +1,72 @@
+#ifndef IMAGEDECODE_HPP
+#define IMAGEDECODE_HPP
+
+#include <QImage>
+#include <QMutex>
+#include <QRunnable>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <atomic>
+#include <memory>
+
+// An image file being decoded on the global thread pool
+class ImageDecode {
+public:
+    ImageDecode() : ready(false) {}
+
+    static std::shared_ptr<ImageDecode> start(const QString& fileName) {
+        auto decode = std::make_shared<ImageDecode>();
+        pending()++;
+        QThreadPool::globalInstance()->start(new Task(decode, fileName));
+        return decode;
+    }
+
+    // Number of decodes that haven't finished yet, for GetAsyncCount()
+    static std::atomic<int>& pending() {
+        static std::atomic<int> count(0);
+        return count;
+    }
+
+    bool isReady() {
+        QMutexLocker lock(&mutex);
+        return ready;
+    }
+
+    // Blocks until the decode has finished
+    QImage take() {
+        QMutexLocker lock(&mutex);
+        while (!ready) {
+            done.wait(&mutex);
+        }
+        return image;
+    }
+
+private:
+    class Task : public QRunnable {
+    public:
+        Task(std::shared_ptr<ImageDecode> Decode, const QString& FileName) : decode(Decode), fileName(FileName) {}
+
+        void run() override {
+            // Converted here so the upload can hand the rows to GL as they are
+            QImage image = QImage(fileName).convertToFormat(QImage::Format_RGBA8888);
+            image.setText("fname", fileName);
+            QMutexLocker lock(&decode->mutex);
+            decode->image = image;
+            decode->ready = true;
+            decode->done.wakeAll();
+            pending()--;
+        }
+    private:
+        std::shared_ptr<ImageDecode> decode;
+        QString fileName;
+    };
+
+    QMutex mutex;
+    QWaitCondition done;
+    bool ready;
+    QImage image;
+};
+
+#endif
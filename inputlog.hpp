@@ -0,0 +1,222 @@
+#ifndef INPUTLOG_HPP
+#define INPUTLOG_HPP
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QList>
+#include <QPoint>
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "logger.hpp"
+
+// A key, mouse button or wheel step on its way to the Lua callbacks; count > 1 when repeats were coalesced
+struct InputEvent {
+    enum Kind { KeyDown, KeyUp, Char };
+    Kind kind;
+    QByteArray key;
+    bool doubleClick;
+    bool repeat;
+    int count = 1;
+};
+
+static const char* InputCallbackName(InputEvent::Kind kind)
+{
+    static const char* callbacks[] = {"OnKeyDown", "OnKeyUp", "OnChar"};
+    return callbacks[kind];
+}
+
+// Input logs are tab separated text. The first line holds the window size the session was
+// recorded at; every input event then gets an E line and every frame an F line, each with the
+// milliseconds since recording began, the cursor position, and the keyboard modifiers and
+// mouse buttons held at the time (as Qt flags):
+//   pobinput  1  <width>  <height>
+//   E  <ms>  <callback>  <key>  <doubleClick>  <repeat>  <x>  <y>  <modifiers>  <buttons>
+//   F  <ms>  <x>  <y>  <modifiers>  <buttons>
+class InputRecorder {
+public:
+    bool open(const QString& path, int width, int height) {
+        file.setFileName(path);
+        if (!file.open(QFile::WriteOnly | QFile::Truncate | QFile::Text)) {
+            return false;
+        }
+        timer.start();
+        file.write(QByteArray("pobinput\t1\t") + QByteArray::number(width) + "\t" + QByteArray::number(height) + "\n");
+        return true;
+    }
+
+    bool isOpen() const {
+        return file.isOpen();
+    }
+
+    void event(const InputEvent& event, QPoint pos, int modifiers, int buttons) {
+        if (!file.isOpen()) {
+            return;
+        }
+        char line[256];
+        int len = snprintf(line, sizeof(line), "E\t%lld\t%s\t%s\t%d\t%d\t%d\t%d\t%d\t%d\n", (long long)timer.elapsed(),
+                           InputCallbackName(event.kind), event.key.constData(), (int)event.doubleClick, (int)event.repeat,
+                           pos.x(), pos.y(), modifiers, buttons);
+        file.write(line, std::min(len, (int)sizeof(line) - 1));
+    }
+
+    void frame(QPoint pos, int modifiers, int buttons) {
+        if (!file.isOpen()) {
+            return;
+        }
+        char line[128];
+        int len = snprintf(line, sizeof(line), "F\t%lld\t%d\t%d\t%d\t%d\n", (long long)timer.elapsed(), pos.x(), pos.y(), modifiers, buttons);
+        file.write(line, std::min(len, (int)sizeof(line) - 1));
+        // Keeps the log usable if the session ends in a crash
+        file.flush();
+    }
+
+    void close() {
+        file.close();
+    }
+
+private:
+    QFile file;
+    QElapsedTimer timer;
+};
+
+// Plays an input log back one recorded frame per painted frame, as fast as frames can be
+// drawn. While a replay is running the cursor position, modifiers and buttons reported to Lua
+// come from the log instead of the real devices, and the time each frame took is kept for the
+// percentile report printed at the end.
+class InputReplay {
+public:
+    struct Entry {
+        bool isFrame;
+        InputEvent event;
+        QPoint pos;
+        int modifiers;
+        int buttons;
+    };
+
+    InputReplay() : width(0), height(0), modifiers(0), buttons(0), next(0), active(false) {}
+
+    // Returns an error message, or an empty string once the log is loaded
+    QByteArray load(const QString& path) {
+        QFile file(path);
+        if (!file.open(QFile::ReadOnly | QFile::Text)) {
+            return "can't open " + path.toUtf8();
+        }
+        QList<QByteArray> header = file.readLine().trimmed().split('\t');
+        if (header.size() < 4 || header[0] != "pobinput" || header[1] != "1") {
+            return path.toUtf8() + " is not an input log";
+        }
+        width = header[2].toInt();
+        height = header[3].toInt();
+        int lineNum = 1;
+        while (!file.atEnd()) {
+            lineNum++;
+            QByteArray line = file.readLine();
+            line.chop(line.endsWith('\n') ? 1 : 0);
+            if (line.isEmpty()) {
+                continue;
+            }
+            QList<QByteArray> f = line.split('\t');
+            Entry entry{};
+            if (f[0] == "F" && f.size() == 6) {
+                entry.isFrame = true;
+                entry.pos = QPoint(f[2].toInt(), f[3].toInt());
+                entry.modifiers = f[4].toInt();
+                entry.buttons = f[5].toInt();
+            } else if (f[0] == "E" && f.size() == 10 && parseKind(f[2], entry.event.kind)) {
+                entry.isFrame = false;
+                entry.event.key = f[3];
+                entry.event.doubleClick = f[4] == "1";
+                entry.event.repeat = f[5] == "1";
+                entry.pos = QPoint(f[6].toInt(), f[7].toInt());
+                entry.modifiers = f[8].toInt();
+                entry.buttons = f[9].toInt();
+            } else {
+                return path.toUtf8() + ":" + QByteArray::number(lineNum) + ": malformed entry";
+            }
+            entries.push_back(entry);
+        }
+        active = true;
+        return QByteArray();
+    }
+
+    // Applies the state recorded for the next frame, handing any events that came before it
+    // to dispatch with the cursor where it was at the time. Returns false once the log is used up.
+    template <typename Dispatch>
+    bool beginFrame(Dispatch&& dispatch) {
+        while (next < entries.size()) {
+            const Entry& entry = entries[next++];
+            cursor = entry.pos;
+            modifiers = entry.modifiers;
+            buttons = entry.buttons;
+            if (entry.isFrame) {
+                return true;
+            }
+            dispatch(entry.event);
+        }
+        return false;
+    }
+
+    void endFrame(qint64 frameNs) {
+        frameTimesNs.push_back(frameNs);
+    }
+
+    bool isActive() const {
+        return active;
+    }
+
+    void stop() {
+        active = false;
+    }
+
+    void report() const {
+        if (frameTimesNs.empty()) {
+            LogPrintf("Replay: no frames were drawn");
+            return;
+        }
+        std::vector<qint64> sorted(frameTimesNs);
+        std::sort(sorted.begin(), sorted.end());
+        double total = 0;
+        for (qint64 ns : sorted) {
+            total += ns;
+        }
+        auto percentile = [&sorted](double p) {
+            size_t i = (size_t)(p / 100.0 * (sorted.size() - 1) + 0.5);
+            return sorted[i] / 1e6;
+        };
+        LogPrintf("Replay: %zu frames at %dx%d", sorted.size(), width, height);
+        LogPrintf("  mean %8.3f ms", total / sorted.size() / 1e6);
+        LogPrintf("  p50  %8.3f ms", percentile(50));
+        LogPrintf("  p90  %8.3f ms", percentile(90));
+        LogPrintf("  p95  %8.3f ms", percentile(95));
+        LogPrintf("  p99  %8.3f ms", percentile(99));
+        LogPrintf("  max  %8.3f ms", sorted.back() / 1e6);
+    }
+
+    int width;
+    int height;
+    QPoint cursor;
+    int modifiers;
+    int buttons;
+
+private:
+    static bool parseKind(const QByteArray& name, InputEvent::Kind& kind) {
+        for (InputEvent::Kind k : {InputEvent::KeyDown, InputEvent::KeyUp, InputEvent::Char}) {
+            if (name == InputCallbackName(k)) {
+                kind = k;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Entry> entries;
+    size_t next;
+    bool active;
+    std::vector<qint64> frameTimesNs;
+};
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef LOGGER_HPP
+#define LOGGER_HPP
+
+#include <QFile>
+#include <QString>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// ======
+// Logger
+// ======
+
+// Log lines from any thread go into a fixed ring of slots (a bounded MPMC queue used with a
+// single consumer): claiming a slot is one CAS, the text is copied in, and a background thread
+// writes everything out to stderr or a rotating file. Nothing on the calling side blocks,
+// allocates (short of lines too long for a slot) or makes a system call. When the ring is
+// full the line is dropped and counted instead.
+class Logger {
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(wakeMutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+        if (file) {
+            fclose(file);
+        }
+    }
+
+    // Queues one line of up to len bytes, written by fill(char* dest, size_t len) with the
+    // length that was actually reserved; a newline is added on output. fill must not call
+    // back into Lua, since an error thrown past it would leave the slot claimed for good.
+    template <typename Fill>
+    void write(size_t len, Fill&& fill) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        Slot* slot;
+        for (;;) {
+            slot = &ring[pos & (SLOT_COUNT - 1)];
+            size_t seq = slot->sequence.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if (dif == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (dif < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        char* dest = slot->text;
+        slot->heap = nullptr;
+        if (len > INLINE_SIZE) {
+            // Rare enough that a malloc is fine; if even that fails the line is cut short
+            slot->heap = (char*)malloc(len);
+            if (slot->heap) {
+                dest = slot->heap;
+            } else {
+                len = INLINE_SIZE;
+            }
+        }
+        slot->length = (uint32_t)len;
+        fill(dest, len);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    void write(const char* text, size_t len) {
+        write(len, [text](char* dest, size_t destLen) {
+            memcpy(dest, text, destLen);
+        });
+    }
+
+    void vprintf(const char* fmt, va_list va) {
+        char buf[INLINE_SIZE + 1];
+        va_list copy;
+        va_copy(copy, va);
+        int len = vsnprintf(buf, sizeof(buf), fmt, copy);
+        va_end(copy);
+        if (len < 0) {
+            return;
+        }
+        if ((size_t)len < sizeof(buf)) {
+            write(buf, len);
+            return;
+        }
+        std::string text(len + 1, '\0');
+        vsnprintf(&text[0], len + 1, fmt, va);
+        write(text.data(), len);
+    }
+
+    // Sends output to path instead of stderr. When the file passes maxBytes it becomes path.1,
+    // older files move up to path.<keep> and the oldest is deleted.
+    bool openFile(const QString& path, qint64 maxBytes = 4 << 20, int keep = 3) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        filePath = QFile::encodeName(path).constData();
+        fileLimit = maxBytes;
+        fileKeep = keep;
+        if (file) {
+            fclose(file);
+        }
+        file = fopen(filePath.c_str(), "a");
+        if (!file) {
+            return false;
+        }
+        fseek(file, 0, SEEK_END);
+        fileBytes = ftell(file);
+        return true;
+    }
+
+    // Writes out everything queued so far from the calling thread, for when the process is about
+    // to die (a Lua panic) and the writer thread won't get another pass
+    void flush() {
+        std::lock_guard<std::mutex> lock(drainMutex);
+        std::string batch;
+        collect(batch);
+        if (!batch.empty()) {
+            output(batch);
+        }
+    }
+
+    quint64 droppedCount() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    quint64 writtenCount() const {
+        return written.load(std::memory_order_relaxed);
+    }
+
+private:
+    static const size_t SLOT_COUNT = 4096;
+    static const size_t INLINE_SIZE = 240;
+
+    struct Slot {
+        std::atomic<size_t> sequence;
+        uint32_t length;
+        char* heap;
+        char text[INLINE_SIZE];
+    };
+
+    Logger() : ring(new Slot[SLOT_COUNT]), enqueuePos(0), dequeuePos(0), dropped(0), written(0), reportedDrops(0), stopping(false),
+            file(nullptr), fileBytes(0), fileLimit(0), fileKeep(0) {
+        for (size_t i = 0; i < SLOT_COUNT; i++) {
+            ring[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        writer = std::thread([this]() { run(); });
+    }
+
+    // Writer thread: drains the ring into one buffer per pass, then sleeps a little when idle
+    // rather than having producers wake it
+    void run() {
+        std::string batch;
+        for (;;) {
+            bool stop;
+            {
+                std::lock_guard<std::mutex> lock(wakeMutex);
+                stop = stopping;
+            }
+            size_t lines;
+            {
+                std::lock_guard<std::mutex> lock(drainMutex);
+                lines = collect(batch);
+                if (!batch.empty()) {
+                    output(batch);
+                    batch.clear();
+                }
+            }
+            if (lines) {
+                continue;
+            }
+            if (stop) {
+                return;
+            }
+            std::unique_lock<std::mutex> lock(wakeMutex);
+            wake.wait_for(lock, std::chrono::milliseconds(20), [this]() { return stopping; });
+        }
+    }
+
+    // Takes the queued lines and a note of any drops since last time; drainMutex must be held
+    size_t collect(std::string& batch) {
+        size_t lines = drain(batch);
+        quint64 drops = dropped.load(std::memory_order_relaxed);
+        if (drops != reportedDrops) {
+            batch += "[log] " + std::to_string(drops - reportedDrops) + " lines dropped\n";
+            reportedDrops = drops;
+        }
+        return lines;
+    }
+
+    size_t drain(std::string& batch) {
+        size_t lines = 0;
+        for (;;) {
+            Slot* slot = &ring[dequeuePos & (SLOT_COUNT - 1)];
+            if (slot->sequence.load(std::memory_order_acquire) != dequeuePos + 1) {
+                return lines;
+            }
+            if (slot->heap) {
+                batch.append(slot->heap, slot->length);
+                free(slot->heap);
+            } else {
+                batch.append(slot->text, slot->length);
+            }
+            batch += '\n';
+            slot->sequence.store(dequeuePos + SLOT_COUNT, std::memory_order_release);
+            dequeuePos++;
+            lines++;
+            written.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void output(const std::string& batch) {
+        std::lock_guard<std::mutex> lock(outputMutex);
+        if (!file) {
+            fwrite(batch.data(), 1, batch.size(), stderr);
+            fflush(stderr);
+            return;
+        }
+        if (fileLimit > 0 && fileBytes > 0 && fileBytes + (qint64)batch.size() > fileLimit) {
+            rotate();
+        }
+        if (file) {
+            fwrite(batch.data(), 1, batch.size(), file);
+            fflush(file);
+            fileBytes += batch.size();
+        } else {
+            fwrite(batch.data(), 1, batch.size(), stderr);
+        }
+    }
+
+    void rotate() {
+        fclose(file);
+        for (int i = fileKeep; i > 0; i--) {
+            std::string from = i == 1 ? filePath : filePath + "." + std::to_string(i - 1);
+            std::string to = filePath + "." + std::to_string(i);
+            remove(to.c_str());
+            rename(from.c_str(), to.c_str());
+        }
+        file = fopen(filePath.c_str(), "w");
+        fileBytes = 0;
+    }
+
+    std::unique_ptr<Slot[]> ring;
+    std::atomic<size_t> enqueuePos;
+    size_t dequeuePos;
+    std::atomic<quint64> dropped;
+    std::atomic<quint64> written;
+    // Held by whichever thread is consuming the ring: the writer, or flush()
+    std::mutex drainMutex;
+    quint64 reportedDrops;
+
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread writer;
+
+    std::mutex outputMutex;
+    FILE* file;
+    std::string filePath;
+    qint64 fileBytes;
+    qint64 fileLimit;
+    int fileKeep;
+};
+
+static inline void LogPrintf(const char* fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    Logger::instance().vprintf(fmt, va);
+    va_end(va);
+}
+
+#endif
@@ -0,0 +1,230 @@
+#ifndef LUAALLOC_HPP
+#define LUAALLOC_HPP
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "logger.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// Size-class pool allocator for a single lua_State. Blocks up to 512 bytes come from
+// 16-byte-granular free lists carved out of 64K slabs; anything larger goes to malloc.
+// Lua tells the allocator the old size of every block, so no headers are needed, and
+// since a state is only used from one thread at a time there is no locking.
+class LuaAllocator {
+public:
+    LuaAllocator() : active(false), bytes(0), peakBytes(0), allocations(0), frees(0), reserved(0), slabCursor(nullptr), slabLeft(0) {
+        memset(freeLists, 0, sizeof(freeLists));
+    }
+
+    LuaAllocator(const LuaAllocator&) = delete;
+    LuaAllocator& operator=(const LuaAllocator&) = delete;
+
+    ~LuaAllocator() {
+        for (void* slab : slabs) {
+            free(slab);
+        }
+    }
+
+    // Creates a state using this allocator. LuaJIT builds that can't take a custom
+    // allocator (64-bit without GC64) return NULL from lua_newstate(), in which case
+    // this falls back to luaL_newstate() and active stays false.
+    lua_State* newState() {
+        lua_State* L = lua_newstate(Alloc, this);
+        if (L) {
+            active = true;
+            lua_atpanic(L, Panic);
+            return L;
+        }
+        L = luaL_newstate();
+        if (L) {
+            lua_atpanic(L, Panic);
+        }
+        return L;
+    }
+
+    bool active;
+    size_t bytes;
+    size_t peakBytes;
+    size_t allocations;
+    size_t frees;
+    size_t reserved;
+
+private:
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t MAX_POOLED = 512;
+    static constexpr size_t CLASS_COUNT = MAX_POOLED / GRANULE;
+    static constexpr size_t SLAB_SIZE = 64 << 10;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    static size_t sizeClass(size_t size) {
+        return (size + GRANULE - 1) / GRANULE - 1;
+    }
+
+    void* allocate(size_t size) {
+        void* block = size > MAX_POOLED ? malloc(size) : allocatePooled(size);
+        // Only successful allocations count; a failed one leaves the stats as they were
+        if (block) {
+            allocations++;
+            bytes += size;
+            if (bytes > peakBytes) {
+                peakBytes = bytes;
+            }
+        }
+        return block;
+    }
+
+    void* allocatePooled(size_t size) {
+        size_t c = sizeClass(size);
+        if (FreeBlock* block = freeLists[c]) {
+            freeLists[c] = block->next;
+            return block;
+        }
+        size_t blockSize = (c + 1) * GRANULE;
+        if (slabLeft < blockSize) {
+            // The tail of the old slab is too small for this class; hand it to the smaller classes
+            while (slabLeft >= GRANULE) {
+                size_t tail = std::min(slabLeft, MAX_POOLED) / GRANULE - 1;
+                release(slabCursor, tail);
+                slabCursor += (tail + 1) * GRANULE;
+                slabLeft -= (tail + 1) * GRANULE;
+            }
+            slabCursor = (char*)malloc(SLAB_SIZE);
+            if (!slabCursor) {
+                slabLeft = 0;
+                return nullptr;
+            }
+            slabs.push_back(slabCursor);
+            slabLeft = SLAB_SIZE;
+            reserved += SLAB_SIZE;
+        }
+        void* block = slabCursor;
+        slabCursor += blockSize;
+        slabLeft -= blockSize;
+        return block;
+    }
+
+    void deallocate(void* ptr, size_t size) {
+        frees++;
+        bytes -= size;
+        if (size > MAX_POOLED) {
+            free(ptr);
+        } else {
+            release(ptr, sizeClass(size));
+        }
+    }
+
+    void release(void* ptr, size_t c) {
+        auto block = (FreeBlock*)ptr;
+        block->next = freeLists[c];
+        freeLists[c] = block;
+    }
+
+    static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+        auto pool = (LuaAllocator*)ud;
+        if (nsize == 0) {
+            if (ptr) {
+                pool->deallocate(ptr, osize);
+            }
+            return nullptr;
+        }
+        if (!ptr) {
+            return pool->allocate(nsize);
+        }
+        // Resizing within a size class (or between two large blocks) keeps the block where it is
+        if (osize <= MAX_POOLED && nsize <= MAX_POOLED && sizeClass(osize) == sizeClass(nsize)) {
+            pool->bytes += nsize - osize;
+            if (pool->bytes > pool->peakBytes) {
+                pool->peakBytes = pool->bytes;
+            }
+            return ptr;
+        }
+        if (osize > MAX_POOLED && nsize > MAX_POOLED) {
+            void* block = realloc(ptr, nsize);
+            if (block) {
+                pool->bytes += nsize - osize;
+                if (pool->bytes > pool->peakBytes) {
+                    pool->peakBytes = pool->bytes;
+                }
+            }
+            return block;
+        }
+        void* block = pool->allocate(nsize);
+        if (!block) {
+            if (nsize > osize) {
+                return nullptr;
+            }
+            // Lua assumes shrinking never fails, so keep the old block; it is big enough for
+            // nsize. A large one will be released into a free list from now on, so adopt it
+            // as a slab to have it freed with the others.
+            if (osize > MAX_POOLED) {
+                try {
+                    pool->slabs.push_back(ptr);
+                    pool->reserved += osize;
+                } catch (const std::bad_alloc&) {
+                    // Out of memory entirely; the block just won't be freed with the pool
+                }
+            }
+            pool->bytes += nsize - osize;
+            return ptr;
+        }
+        memcpy(block, ptr, std::min(osize, nsize));
+        pool->deallocate(ptr, osize);
+        return block;
+    }
+
+    // The process aborts when this returns, so the log is written out here rather than lost
+    static int Panic(lua_State* L) {
+        LogPrintf("PANIC: unprotected error in call to Lua API (%s)", lua_tostring(L, -1));
+        Logger::instance().flush();
+        return 0;
+    }
+
+    FreeBlock* freeLists[CLASS_COUNT];
+    std::vector<void*> slabs;
+    char* slabCursor;
+    size_t slabLeft;
+};
+
+// GetAllocStats(): allocator counters for the calling state. The allocator is the closure's upvalue.
+static int l_GetAllocStats(lua_State* L)
+{
+    auto pool = (LuaAllocator*)lua_touserdata(L, lua_upvalueindex(1));
+    lua_createtable(L, 0, 6);
+    lua_pushboolean(L, pool->active);
+    lua_setfield(L, -2, "pooled");
+    if (pool->active) {
+        lua_pushnumber(L, (lua_Number)pool->bytes);
+    } else {
+        lua_pushnumber(L, lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0));
+    }
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, (lua_Number)pool->peakBytes);
+    lua_setfield(L, -2, "peakBytes");
+    lua_pushnumber(L, (lua_Number)pool->allocations);
+    lua_setfield(L, -2, "allocations");
+    lua_pushnumber(L, (lua_Number)pool->frees);
+    lua_setfield(L, -2, "frees");
+    lua_pushnumber(L, (lua_Number)pool->reserved);
+    lua_setfield(L, -2, "reserved");
+    return 1;
+}
+
+static void RegisterAllocStats(lua_State* L, LuaAllocator* pool)
+{
+    lua_pushlightuserdata(L, pool);
+    lua_pushcclosure(L, l_GetAllocStats, 1);
+    lua_setglobal(L, "GetAllocStats");
+}
+
+#endif
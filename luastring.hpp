@@ -0,0 +1,64 @@
+#ifndef LUASTRING_HPP
+#define LUASTRING_HPP
+
+#include <QByteArray>
+#include <QLatin1String>
+#include <QString>
+
+extern "C" {
+    #include "lua.h"
+}
+
+// =================
+// Lua string bridge
+// =================
+
+// Lua strings are UTF-8 on the Qt side, as QString(const char*) always assumed. Going through
+// these instead of toStdString().c_str() saves a std::string copy and a strlen() per string.
+
+// Pushes the bytes as they are; Lua's own copy is the only one made
+static inline void PushByteArray(lua_State* L, const QByteArray& bytes)
+{
+    lua_pushlstring(L, bytes.constData(), bytes.size());
+}
+
+static inline void PushQString(lua_State* L, const QString& str)
+{
+    PushByteArray(L, str.toUtf8());
+}
+
+// Decodes using the length Lua already knows rather than scanning for the terminator
+static inline QString ToQString(lua_State* L, int index)
+{
+    size_t len;
+    const char* str = lua_tolstring(L, index, &len);
+    return QString::fromUtf8(str, (int)len);
+}
+
+// Borrows the string for comparing against ASCII names without converting it.
+// Only valid while the value stays on the stack.
+static inline QLatin1String ToLatin1View(lua_State* L, int index)
+{
+    size_t len;
+    const char* str = lua_tolstring(L, index, &len);
+    return QLatin1String(str, (int)len);
+}
+
+// UTF-8 encoding of a string that rarely changes, redone only when its contents do.
+// Comparing against a string that still shares the cached copy's data costs nothing.
+class Utf8Cache {
+public:
+    const QByteArray& get(const QString& str) {
+        if (str != source || utf8.isNull()) {
+            source = str;
+            utf8 = str.toUtf8();
+        }
+        return utf8;
+    }
+
+private:
+    QString source;
+    QByteArray utf8;
+};
+
+#endif
@@ -1,17 +1,32 @@
 #include <QClipboard>
 #include <QColor>
+#include <QDirIterator>
 #include <QFontDatabase>
 #include <QKeyEvent>
+#include <QStandardPaths>
 #include <QtGui/QGuiApplication>
 
+#include <cstring>
+#include <future>
 #include <iostream>
 
 #include <zlib.h>
+#include "blob.hpp"
+#include "buildcode.hpp"
+#include "buildindex.hpp"
+#include "compress.hpp"
+#include "datapack.hpp"
+#include "imagedecode.hpp"
+#include "logger.hpp"
+#include "luaalloc.hpp"
+#include "luastring.hpp"
 #include "main.h"
 #include "pobwindow.hpp"
 #include "subscript.hpp"
+#include "xmlparser.hpp"
 
 lua_State *L;
+LuaAllocator luaAllocator;
 
 int dscount;
 
@@ -19,12 +34,36 @@ POBWindow *pobwindow;
 
 QRegularExpression colourCodes{R"((\^x.{6})|(\^\d))"};
 
+// pushCallback() resolves MainObject and its methods once and keeps registry references to them;
+// SetCallback() and SetMainObject() drop the references so the next call looks them up again
+std::map<std::string, int> callbackRefs;
+int mainObjectRef = LUA_NOREF;
+
+void invalidateCallbacks() {
+    for (auto& ref : callbackRefs) {
+        luaL_unref(L, LUA_REGISTRYINDEX, ref.second);
+    }
+    callbackRefs.clear();
+    luaL_unref(L, LUA_REGISTRYINDEX, mainObjectRef);
+    mainObjectRef = LUA_NOREF;
+}
+
 void pushCallback(const char* name) {
-    lua_getfield(L, LUA_REGISTRYINDEX, "uicallbacks");
-    lua_getfield(L, -1, "MainObject");
-    lua_remove(L, -2);
-    lua_getfield(L, -1, name);
-    lua_insert(L, -2);
+    if (mainObjectRef == LUA_NOREF) {
+        lua_getfield(L, LUA_REGISTRYINDEX, "uicallbacks");
+        lua_getfield(L, -1, "MainObject");
+        lua_remove(L, -2);
+        mainObjectRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    auto ref = callbackRefs.find(name);
+    if (ref == callbackRefs.end()) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, mainObjectRef);
+        lua_getfield(L, -1, name);
+        ref = callbackRefs.emplace(name, luaL_ref(L, LUA_REGISTRYINDEX)).first;
+        lua_pop(L, 1);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref->second);
+    lua_rawgeti(L, LUA_REGISTRYINDEX, mainObjectRef);
 }
 
 void POBWindow::triggerUpdate() {
@@ -34,6 +73,7 @@ void POBWindow::triggerUpdate() {
 }
 
 void POBWindow::initializeGL() {
+    startupReport.begin("gl");
     QImage wimg{1, 1, QImage::Format_Mono};
     wimg.fill(1);
     white.reset(new QOpenGLTexture(wimg));
@@ -49,6 +89,7 @@ void POBWindow::initializeGL() {
 //    glAlphaFunc(GL_GREATER, 0);
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    startupReport.end("gl");
 }
 
 void POBWindow::resizeGL(int w, int h) {
@@ -57,17 +98,39 @@ void POBWindow::resizeGL(int w, int h) {
 }
 
 void POBWindow::paintGL() {
-    isDrawing = true;
+    QElapsedTimer frameTimer;
+    frameTimer.start();
     glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
+    // The window is shown while Launch.lua is still loading
+    if (!luaReady) {
+        return;
+    }
+    if (inputReplay.isActive() && !inputReplay.beginFrame([this](const InputEvent& event) { routeInput(event); })) {
+        inputReplay.stop();
+        inputReplay.report();
+        QCoreApplication::quit();
+        return;
+    }
+    inputRecorder.frame(cursorPos(), keyboardModifiers(), mouseButtons());
+    // Input and subscript progress handlers run before OnFrame, so they still can't draw
+    subScriptProgress();
+    flushInput();
+    isDrawing = true;
     glColor4f(0, 0, 0, 0);
 
     for (auto& layer : layers) {
         layer.second.clear();
     }
     dscount = 0;
+    textPending = false;
     curLayer = 0;
     curSubLayer = 0;
 
+    // A recording left open by an error in the previous frame
+    recordingList.reset();
+
+    textureUploader.process(white);
+
     pushCallback("OnFrame");
     int result = lua_pcall(L, 1, 0, 0);
     if (result != 0) {
@@ -84,180 +147,333 @@ void POBWindow::paintGL() {
         }
     }
     isDrawing = false;
+    startupReport.print();
+    gcScheduler.afterFrame(frameTimer.elapsed());
+    if (textureUploader.queueDepth() > 0 || textPending) {
+        update();
+    }
+    if (inputReplay.isActive()) {
+        inputReplay.endFrame(frameTimer.nsecsElapsed());
+        update();
+    }
 }
 
 void POBWindow::subScriptFinished() {
-    bool clean = true;
-    for (int i = 0;i < subScriptList.size();i++) {
-        if (subScriptList[i].get()) {
-            clean = false;
-            if (subScriptList[i]->isFinished()) {
-                subScriptList[i]->onSubFinished(L, i);
-                subScriptList[i].reset();
-            }
+    bool delivered = false;
+    subScriptPool.completed.drain([this, &delivered](std::shared_ptr<SubScript>&& job) {
+        if (job->mapId >= 0) {
+            delivered |= parallelMapChunkFinished(job);
+            return;
+        }
+        // Aborted jobs have already given up their slot, which may since have been reused
+        if (job->aborted || subScriptList[job->id] != job) {
+            return;
         }
+        job->onSubFinished(L);
+        releaseSubScriptSlot(job->id);
+        delivered = true;
+    });
+    if (delivered) {
+        gcScheduler.fullCollect();
     }
-    if (clean) {
-        subScriptList.clear();
+}
+
+void POBWindow::collectSubScriptProgress() {
+    // Only the latest progress message per subscript is kept for the next frame
+    subScriptPool.progress.drain([this](SubScriptProgress&& item) {
+        if (item.job->id >= 0) {
+            pendingProgress[item.job->id] = std::move(item);
+        }
+    });
+}
+
+void POBWindow::subScriptProgressPosted() {
+    collectSubScriptProgress();
+    update();
+}
+
+void POBWindow::subScriptProgress() {
+    collectSubScriptProgress();
+    std::map<int, SubScriptProgress> latest;
+    latest.swap(pendingProgress);
+    for (auto& entry : latest) {
+        auto& item = entry.second;
+        if (!item.job->aborted && subScriptList[item.job->id] == item.job) {
+            item.job->onSubProgress(L, item.values);
+        }
     }
 }
 
+int POBWindow::claimSubScriptSlot(std::shared_ptr<SubScript> job) {
+    if (freeSubScriptSlots.empty()) {
+        subScriptList.append(job);
+        return subScriptList.size() - 1;
+    }
+    int slot = freeSubScriptSlots.back();
+    freeSubScriptSlots.pop_back();
+    subScriptList[slot] = job;
+    return slot;
+}
+
+void POBWindow::releaseSubScriptSlot(int slot) {
+    subScriptList[slot].reset();
+    freeSubScriptSlots.push_back(slot);
+}
+
+// Returns true once the last chunk is in and the callback has been called
+bool POBWindow::parallelMapChunkFinished(const std::shared_ptr<SubScript>& job) {
+    auto it = parallelMaps.find(job->mapId);
+    if (job->aborted || it == parallelMaps.end()) {
+        return false;
+    }
+    ParallelMap& map = it->second;
+    if (job->badResult >= 0) {
+        map.error = "ParallelMap() result " + QByteArray::number(job->badResult) + ": only nil, boolean, number, string and blob can be returned";
+    } else if (!job->error.isEmpty()) {
+        map.error = job->error;
+    }
+    std::move(job->results.begin(), job->results.end(), map.results.begin() + (job->firstIndex - 1));
+    map.running--;
+    if (map.error.isEmpty() && map.nextChunk < map.chunks.size()) {
+        subScriptPool.submit(map.chunks[map.nextChunk++]);
+        map.running++;
+    }
+    if (map.running > 0) {
+        return false;
+    }
+
+    lua_rawgeti(L, LUA_REGISTRYINDEX, map.callbackRef);
+    int nargs = 1;
+    if (map.error.isEmpty()) {
+        lua_createtable(L, map.results.size(), 0);
+        for (size_t i = 0; i < map.results.size(); i++) {
+            PushSubScriptValue(L, map.results[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+    } else {
+        lua_pushnil(L);
+        lua_pushlstring(L, map.error.constData(), map.error.size());
+        nargs = 2;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, map.callbackRef);
+    parallelMaps.erase(it);
+    if (lua_pcall(L, nargs, 0, 0)) {
+        LogPrintf("Error calling ParallelMap callback: %s", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
 void POBWindow::mouseMoveEvent(QMouseEvent *event) {
     update();
 }
 
-void pushMouseString(QMouseEvent *event) {
+const char* mouseString(QMouseEvent *event) {
     switch (event->button()) {
     case Qt::LeftButton:
-        lua_pushstring(L, "LEFTBUTTON");
-        break;
+        return "LEFTBUTTON";
     case Qt::RightButton:
-        lua_pushstring(L, "RIGHTBUTTON");
-        break;
+        return "RIGHTBUTTON";
     case Qt::MiddleButton:
-        lua_pushstring(L, "MIDDLEBUTTON");
-        break;
+        return "MIDDLEBUTTON";
     default:
-        std::cout << "MOUSE STRING? " << event->button() << std::endl;
+        LogPrintf("MOUSE STRING? %d", (int)event->button());
+        return nullptr;
     }
 }
 
 void POBWindow::mousePressEvent(QMouseEvent *event) {
-    pushCallback("OnKeyDown");
-    pushMouseString(event);
-    lua_pushboolean(L, false);
-    int result = lua_pcall(L, 3, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+    if (const char* key = mouseString(event)) {
+        dispatchInput({InputEvent::KeyDown, key, false, false});
     }
 }
 
 void POBWindow::mouseReleaseEvent(QMouseEvent *event) {
-    pushCallback("OnKeyUp");
-    pushMouseString(event);
-    int result = lua_pcall(L, 2, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+    if (const char* key = mouseString(event)) {
+        dispatchInput({InputEvent::KeyUp, key, false, false});
     }
 }
 
 void POBWindow::mouseDoubleClickEvent(QMouseEvent *event) {
-    pushCallback("OnKeyDown");
-    pushMouseString(event);
-    lua_pushboolean(L, true);
-    int result = lua_pcall(L, 3, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+    if (const char* key = mouseString(event)) {
+        dispatchInput({InputEvent::KeyDown, key, true, false});
     }
 }
 
 void POBWindow::wheelEvent(QWheelEvent *event) {
-    pushCallback("OnKeyUp");
     if (event->angleDelta().y() > 0) {
-        lua_pushstring(L, "WHEELUP");
+        dispatchInput({InputEvent::KeyUp, "WHEELUP", false, true});
     } else if (event->angleDelta().y() < 0) {
-        lua_pushstring(L, "WHEELDOWN");
-    } else {
-        return;
-    }
-    lua_pushboolean(L, false);
-    int result = lua_pcall(L, 3, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+        dispatchInput({InputEvent::KeyUp, "WHEELDOWN", false, true});
     }
 }
 
-bool pushKeyString(int keycode) {
+const char* keyString(int keycode) {
     switch (keycode) {
     case Qt::Key_Escape:
-        lua_pushstring(L, "ESCAPE");
-        break;
+        return "ESCAPE";
     case Qt::Key_Tab:
-        lua_pushstring(L, "TAB");
-        break;
+        return "TAB";
     case Qt::Key_Return:
     case Qt::Key_Enter:
-        lua_pushstring(L, "RETURN");
-        break;
+        return "RETURN";
     case Qt::Key_Backspace:
-        lua_pushstring(L, "BACK");
-        break;
+        return "BACK";
     case Qt::Key_Delete:
-        lua_pushstring(L, "DELETE");
-        break;
+        return "DELETE";
     case Qt::Key_Home:
-        lua_pushstring(L, "HOME");
-        break;
+        return "HOME";
     case Qt::Key_End:
-        lua_pushstring(L, "END");
-        break;
+        return "END";
     case Qt::Key_Up:
-        lua_pushstring(L, "UP");
-        break;
+        return "UP";
     case Qt::Key_Down:
-        lua_pushstring(L, "DOWN");
-        break;
+        return "DOWN";
     case Qt::Key_Left:
-        lua_pushstring(L, "LEFT");
-        break;
+        return "LEFT";
     case Qt::Key_Right:
-        lua_pushstring(L, "RIGHT");
-        break;
+        return "RIGHT";
     case Qt::Key_PageUp:
-        lua_pushstring(L, "PAGEUP");
-        break;
+        return "PAGEUP";
     case Qt::Key_PageDown:
-        lua_pushstring(L, "PAGEDOWN");
-        break;
+        return "PAGEDOWN";
     case Qt::Key_F6:
-        lua_pushstring(L, "F6");
-        break;
+        return "F6";
     default:
-        return false;
+        return nullptr;
     }
-    return true;
 }
 
 void POBWindow::keyPressEvent(QKeyEvent *event) {
-    pushCallback("OnKeyDown");
-    if (!pushKeyString(event->key())) {
-        if (event->key() >= ' ' && event->key() <= '~') {
-            char s[2];
-            if (event->key() >= 'A' && event->key() <= 'Z' && !(QGuiApplication::keyboardModifiers() & Qt::ShiftModifier)) {
-                s[0] = event->key() + 32;
-            } else {
-                s[0] = event->key();
-            }
-            s[1] = 0;
-            if (!(QGuiApplication::keyboardModifiers() & Qt::ControlModifier)) {
-                lua_pop(L, 2);
-                pushCallback("OnChar");
-            }
-            lua_pushstring(L, s);
+    if (const char* key = keyString(event->key())) {
+        dispatchInput({InputEvent::KeyDown, key, false, event->isAutoRepeat()});
+    } else if (event->key() >= ' ' && event->key() <= '~') {
+        char s[2];
+        if (event->key() >= 'A' && event->key() <= 'Z' && !(QGuiApplication::keyboardModifiers() & Qt::ShiftModifier)) {
+            s[0] = event->key() + 32;
         } else {
-            lua_pushstring(L, "ASDF");
-            //std::cout << "UNHANDLED KEYDOWN" << std::endl;
+            s[0] = event->key();
         }
-    }
-    lua_pushboolean(L, false);
-    int result = lua_pcall(L, 3, 0, 0);
-    if (result != 0) {
-        lua_error(L);
+        s[1] = 0;
+        bool control = QGuiApplication::keyboardModifiers() & Qt::ControlModifier;
+        dispatchInput({control ? InputEvent::KeyDown : InputEvent::Char, s, false, event->isAutoRepeat()});
+    } else {
+        dispatchInput({InputEvent::KeyDown, "ASDF", false, event->isAutoRepeat()});
+        //std::cout << "UNHANDLED KEYDOWN" << std::endl;
     }
 }
 
 void POBWindow::keyReleaseEvent(QKeyEvent *event) {
-    pushCallback("OnKeyUp");
-    if (!pushKeyString(event->key())) {
-        lua_pushstring(L, "ASDF");
+    // Auto-repeat sends a release before every repeated press; nothing needs to see those
+    if (inputBatching && event->isAutoRepeat()) {
+        return;
+    }
+    const char* key = keyString(event->key());
+    if (!key) {
+        key = "ASDF";
         //std::cout << "UNHANDLED KEYUP" << std::endl;
     }
+    dispatchInput({InputEvent::KeyUp, key, false, false});
+}
+
+// Entry point for events from the real devices. They are logged when recording, and
+// ignored while a replay is feeding its own events through routeInput()
+void POBWindow::dispatchInput(const InputEvent& event) {
+    if (inputReplay.isActive()) {
+        return;
+    }
+    inputRecorder.event(event, cursorPos(), keyboardModifiers(), mouseButtons());
+    routeInput(event);
+}
+
+void POBWindow::routeInput(const InputEvent& event) {
+    if (!inputBatching) {
+        deliverInput(event);
+        return;
+    }
+    // Repeated wheel steps and held keys collapse into one entry with a count
+    if (event.repeat && !inputQueue.empty()) {
+        InputEvent& last = inputQueue.back();
+        if (last.kind == event.kind && last.key == event.key && last.repeat) {
+            last.count++;
+            return;
+        }
+    }
+    inputQueue.push_back(event);
+    update();
+}
+
+void POBWindow::deliverInput(const InputEvent& event) {
+    for (int i = 0; i < event.count; i++) {
+        pushCallback(InputCallbackName(event.kind));
+        lua_pushstring(L, event.key.constData());
+        lua_pushboolean(L, event.doubleClick);
+        int result = lua_pcall(L, 3, 0, 0);
+        if (result != 0) {
+            lua_error(L);
+        }
+    }
+}
+
+// Hands the events queued since the last frame to MainObject:OnInputBatch(events) as
+// { kind = "KeyDown"|"KeyUp"|"Char", key, doubleClick, count } entries, or to the
+// individual callbacks if the main object has no OnInputBatch
+void POBWindow::flushInput() {
+    if (inputQueue.empty()) {
+        return;
+    }
+    std::vector<InputEvent> events;
+    events.swap(inputQueue);
+    pushCallback("OnInputBatch");
+    if (!lua_isfunction(L, -2)) {
+        lua_pop(L, 2);
+        for (auto& event : events) {
+            deliverInput(event);
+        }
+        return;
+    }
+    static const char* kinds[] = {"KeyDown", "KeyUp", "Char"};
+    lua_createtable(L, (int)events.size(), 0);
+    for (size_t i = 0; i < events.size(); i++) {
+        lua_createtable(L, 0, 4);
+        lua_pushstring(L, kinds[events[i].kind]);
+        lua_setfield(L, -2, "kind");
+        lua_pushstring(L, events[i].key.constData());
+        lua_setfield(L, -2, "key");
+        lua_pushboolean(L, events[i].doubleClick);
+        lua_setfield(L, -2, "doubleClick");
+        lua_pushinteger(L, events[i].count);
+        lua_setfield(L, -2, "count");
+        lua_rawseti(L, -2, (int)i + 1);
+    }
     int result = lua_pcall(L, 2, 0, 0);
     if (result != 0) {
         lua_error(L);
     }
 }
 
+// Device state as Lua should see it: taken from the log while a replay is running
+QPoint POBWindow::cursorPos() {
+    if (inputReplay.isActive()) {
+        return inputReplay.cursor;
+    }
+    return mapFromGlobal(QCursor::pos());
+}
+
+int POBWindow::keyboardModifiers() {
+    if (inputReplay.isActive()) {
+        return inputReplay.modifiers;
+    }
+    return QGuiApplication::keyboardModifiers();
+}
+
+int POBWindow::mouseButtons() {
+    if (inputReplay.isActive()) {
+        return inputReplay.buttons;
+    }
+    return QGuiApplication::mouseButtons();
+}
+
 void POBWindow::LAssert(lua_State* L, int cond, const char* fmt, ...) {
     if ( !cond ) {
         va_list va;
@@ -294,6 +510,9 @@ void POBWindow::SetDrawLayer(int layer, int subLayer) {
 
 
 void POBWindow::AppendCmd(std::unique_ptr<Cmd> cmd) {
+    if (recordingList && cmd->capture(*recordingList)) {
+        return;
+    }
     layers[{curLayer, curSubLayer}].emplace_back(std::move(cmd));
 }
 
@@ -390,6 +609,7 @@ static int l_SetCallback(lua_State* L)
         lua_pushnil(L);
     }
     lua_settable(L, lua_upvalueindex(1));
+    invalidateCallbacks();
     return 0;
 }
 
@@ -414,6 +634,30 @@ static int l_SetMainObject(lua_State* L)
         lua_pushnil(L);
     }
     lua_settable(L, lua_upvalueindex(1));
+    invalidateCallbacks();
+    return 0;
+}
+
+static int l_SetGCScheduling(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: SetGCScheduling(enabled)");
+    pobwindow->gcScheduler.setEnabled(lua_toboolean(L, 1) != 0);
+    return 0;
+}
+
+static int l_GetGCStats(lua_State* L)
+{
+    pobwindow->gcScheduler.push(L);
+    return 1;
+}
+
+// Queues input events and delivers them once per frame through OnInputBatch
+static int l_SetInputBatching(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: SetInputBatching(enabled)");
+    pobwindow->inputBatching = lua_toboolean(L, 1) != 0;
     return 0;
 }
 
@@ -424,6 +668,9 @@ static int l_SetMainObject(lua_State* L)
 struct imgHandle_s {
     std::shared_ptr<QOpenGLTexture> *hnd;
     QImage* img;
+    std::shared_ptr<ImageDecode> *decode;
+    std::shared_ptr<TextureUpload> *upload;
+    int flags;
 };
 
 static int l_NewImageHandle(lua_State* L)
@@ -431,6 +678,9 @@ static int l_NewImageHandle(lua_State* L)
     auto imgHandle = (imgHandle_s*)lua_newuserdata(L, sizeof(imgHandle_s));
     imgHandle->hnd = nullptr;
     imgHandle->img = nullptr;
+    imgHandle->decode = nullptr;
+    imgHandle->upload = nullptr;
+    imgHandle->flags = 0;
     lua_pushvalue(L, lua_upvalueindex(1));
     lua_setmetatable(L, -2);
     return 1;
@@ -447,11 +697,58 @@ static imgHandle_s* GetImgHandle(lua_State* L, const char* method, bool loaded)
     return imgHandle;
 }
 
+// Collects the decoded image once the background decode is done; blocks unless wait is false
+static bool ImgHandleDecoded(imgHandle_s* imgHandle, bool wait)
+{
+    if (imgHandle->decode == nullptr) {
+        return true;
+    }
+    if (!wait && !(*imgHandle->decode)->isReady()) {
+        return false;
+    }
+    *imgHandle->img = (*imgHandle->decode)->take();
+    delete imgHandle->decode;
+    imgHandle->decode = nullptr;
+    return true;
+}
+
+// Makes sure the handle's texture exists, starting its upload once the image is decoded.
+// Images loaded without ASYNC are uploaded on the spot; ASYNC ones wait their turn in the
+// upload queue and return false until they're done, like they do while decoding.
+static bool ImgHandleUploaded(imgHandle_s* imgHandle)
+{
+    if (imgHandle->hnd->get() != nullptr) {
+        return true;
+    }
+    bool async = imgHandle->flags & TF_ASYNC;
+    if (!ImgHandleDecoded(imgHandle, !async)) {
+        return false;
+    }
+    if (imgHandle->upload == nullptr) {
+        imgHandle->upload = new std::shared_ptr<TextureUpload>(std::make_shared<TextureUpload>(*imgHandle->img));
+    }
+    std::shared_ptr<TextureUpload>& upload = *imgHandle->upload;
+    if (async) {
+        pobwindow->textureUploader.enqueue(upload);
+    } else {
+        pobwindow->textureUploader.uploadNow(upload, pobwindow->white);
+    }
+    if (!upload->isDone()) {
+        return false;
+    }
+    *imgHandle->hnd = upload->texture;
+    delete imgHandle->upload;
+    imgHandle->upload = nullptr;
+    return true;
+}
+
 static int l_imgHandleGC(lua_State* L)
 {
     imgHandle_s* imgHandle = GetImgHandle(L, "__gc", false);
     delete imgHandle->hnd;
     delete imgHandle->img;
+    delete imgHandle->decode;
+    delete imgHandle->upload;
     return 0;
 }
 
@@ -488,9 +785,12 @@ static int l_imgHandleLoad(lua_State* L)
             pobwindow->LAssert(L, 0, "imgHandle:Load(): unrecognised flag '%s'", flag);
         }
     }
+    imgHandle->flags = flags;
     imgHandle->img = new QImage();
-    imgHandle->img->load(fullFileName);
-    imgHandle->img->setText("fname", fullFileName);
+    delete imgHandle->upload;
+    imgHandle->upload = nullptr;
+    delete imgHandle->decode;
+    imgHandle->decode = new std::shared_ptr<ImageDecode>(ImageDecode::start(fullFileName));
     //imgHandle->hnd = new QOpenGLTexture(img);
     //pobwindow->renderer->RegisterShader(fullFileName, flags);
     return 0;
@@ -503,6 +803,10 @@ static int l_imgHandleUnload(lua_State* L)
     imgHandle->hnd = nullptr;
     delete imgHandle->img;
     imgHandle->img = nullptr;
+    delete imgHandle->decode;
+    imgHandle->decode = nullptr;
+    delete imgHandle->upload;
+    imgHandle->upload = nullptr;
     return 0;
 }
 
@@ -516,9 +820,7 @@ static int l_imgHandleIsValid(lua_State* L)
 static int l_imgHandleIsLoading(lua_State* L)
 {
     imgHandle_s* imgHandle = GetImgHandle(L, "IsLoading", true);
-//	int width, height;
-//	pobwindow->renderer->GetShaderImageSize(imgHandle->hnd, width, height);
-    lua_pushboolean(L, false);
+    lua_pushboolean(L, !ImgHandleDecoded(imgHandle, false));
     return 1;
 }
 
@@ -535,6 +837,7 @@ static int l_imgHandleSetLoadingPriority(lua_State* L)
 static int l_imgHandleImageSize(lua_State* L)
 {
     imgHandle_s* imgHandle = GetImgHandle(L, "ImageSize", true);
+    ImgHandleDecoded(imgHandle, true);
     QSize size(imgHandle->img->size());
     lua_pushinteger(L, size.width());
     lua_pushinteger(L, size.height());
@@ -655,14 +958,14 @@ static int l_DrawImage(lua_State* L)
     std::shared_ptr<QOpenGLTexture> hnd;
     if ( !lua_isnil(L, 1) ) {
         auto imgHandle = (imgHandle_s*)lua_touserdata(L, 1);
-        if (imgHandle->hnd->get() == nullptr) {
-            imgHandle->hnd->reset(new QOpenGLTexture(*(imgHandle->img)));
-            if (!(*imgHandle->hnd)->isCreated()) {
-                //std::cout << "BROKEN TEXTURE " << imgHandle->img->text("fname").toStdString() << std::endl;
-                *imgHandle->hnd = pobwindow->white;
+        pobwindow->LAssert(L, imgHandle->hnd != nullptr, "DrawImage(): image handle has no image loaded");
+        if (!ImgHandleUploaded(imgHandle)) {
+            // Asynchronously loaded image isn't decoded or uploaded yet
+            if (pobwindow->recordingList) {
+                pobwindow->recordingList->complete = false;
             }
+            return 0;
         }
-        pobwindow->LAssert(L, imgHandle->hnd != nullptr, "DrawImage(): image handle has no image loaded");
         hnd = *imgHandle->hnd;
     }
     float arg[8];
@@ -683,7 +986,7 @@ static int l_DrawImage(lua_State* L)
     return 0;
 }
 
-void DrawImageQuadCmd::execute() {
+static void DrawQuad(const std::shared_ptr<QOpenGLTexture>& tex, const float x[4], const float y[4], const float s[4], const float t[4]) {
     if (tex != nullptr && tex->isCreated()) {
         tex->bind();
     } else {
@@ -697,6 +1000,20 @@ void DrawImageQuadCmd::execute() {
     glEnd();
 }
 
+void DrawImageQuadCmd::execute() {
+    DrawQuad(tex, x, y, s, t);
+}
+
+bool DrawImageQuadCmd::capture(DrawList& list) const {
+    list.addQuad(tex, x, y, s, t);
+    return true;
+}
+
+bool ColorCmd::capture(DrawList& list) const {
+    list.setColor(col);
+    return true;
+}
+
 static int l_DrawImageQuad(lua_State* L)
 {
     pobwindow->LAssert(L, pobwindow->isDrawing, "DrawImageQuad() called outside of OnFrame");
@@ -706,14 +1023,14 @@ static int l_DrawImageQuad(lua_State* L)
     std::shared_ptr<QOpenGLTexture> hnd;
     if ( !lua_isnil(L, 1) ) {
         auto imgHandle = (imgHandle_s*)lua_touserdata(L, 1);
-        if ((*imgHandle->hnd).get() == nullptr) {
-            (*imgHandle->hnd).reset(new QOpenGLTexture(*(imgHandle->img)));
-            if (!(*imgHandle->hnd)->isCreated()) {
-                // std::cout << "BROKEN TEXTURE" << imgHandle->img->text("fname").toStdString() << std::endl;
-                *imgHandle->hnd = pobwindow->white;
+        pobwindow->LAssert(L, imgHandle->hnd != nullptr, "DrawImageQuad(): image handle has no image loaded");
+        if (!ImgHandleUploaded(imgHandle)) {
+            // Asynchronously loaded image isn't decoded or uploaded yet
+            if (pobwindow->recordingList) {
+                pobwindow->recordingList->complete = false;
             }
+            return 0;
         }
-        pobwindow->LAssert(L, imgHandle->hnd != nullptr, "DrawImageQuad(): image handle has no image loaded");
         hnd = *imgHandle->hnd;
     }
     float arg[16];
@@ -734,8 +1051,37 @@ static int l_DrawImageQuad(lua_State* L)
     return 0;
 }
 
+struct StringFont {
+    QString name;
+    QFontMetrics metrics;
+};
+
+// Looked up once per font and pixel size; every line of a string is measured and spaced with these
+static const StringFont& GetStringFont(int Font, int pixelSize) {
+    static std::map<std::pair<int, int>, StringFont> fonts;
+    auto it = fonts.find(std::make_pair(Font, pixelSize));
+    if (it == fonts.end()) {
+        QString fontName;
+        switch (Font) {
+        case 1:
+            fontName = "Liberation Sans";
+            break;
+        case 2:
+            fontName = "Liberation Sans Bold";
+            break;
+        case 0:
+        default:
+            fontName = "Bitstream Vera Mono";
+            break;
+        }
+        QFont font(fontName);
+        font.setPixelSize(pixelSize);
+        it = fonts.emplace(std::make_pair(Font, pixelSize), StringFont{fontName, QFontMetrics(font)}).first;
+    }
+    return it->second;
+}
+
 DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, const char *Text) : text(Text) {
-    dscount++;
     if (text.size() >= 2 && text[0] == '^') {
         switch(text[1].toLatin1()) {
         case '0':
@@ -788,48 +1134,34 @@ DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, co
     }
     text.remove(colourCodes);
 
-    QString cacheKey = (QString::number(Font) + "_" + QString::number(Size) + "_" + text);
-    if (pobwindow->stringCache.contains(cacheKey)) {
-        tex = *pobwindow->stringCache[cacheKey];
-    } else {
-        QString fontName;
-        switch (Font) {
-        case 1:
-            fontName = "Liberation Sans";
-            break;
-        case 2:
-            fontName = "Liberation Sans Bold";
-            break;
-        case 0:
-        default:
-            fontName = "Bitstream Vera Mono";
-            break;
+    int pixelSize = Size + pobwindow->fontFudge;
+    QString keyPrefix = QString::number(Font) + "_" + QString::number(Size) + "_";
+    QStringList lineText = text.split('\n');
+    lines.reserve(lineText.size());
+    int width = 0;
+    for (const QString& part : lineText) {
+        QString cacheKey = keyPrefix + part;
+        std::shared_ptr<TextRaster> raster;
+        if (pobwindow->stringCache.contains(cacheKey)) {
+            raster = *pobwindow->stringCache[cacheKey];
+        } else {
+            const StringFont& font = GetStringFont(Font, pixelSize);
+            raster = TextRaster::start(font.name, pixelSize, part, font.metrics.size(0, part));
+            pobwindow->stringCache.insert(cacheKey, new std::shared_ptr<TextRaster>(raster));
         }
-        QFont font(fontName);
-        font.setPixelSize(Size + pobwindow->fontFudge);
-        QFontMetrics fm(font);
-        QSize size = fm.size(0, text);
-
-        QImage brush(size, QImage::Format_ARGB32);
-        brush.fill(QColor(255, 255, 255, 0));
-        tex = nullptr;
-        if (brush.width() && brush.height()) {
-            QPainter p(&brush);
-            p.setPen(QColor(255, 255, 255, 255));
-            p.setFont(font);
-            p.setCompositionMode(QPainter::CompositionMode_Plus);
-            p.drawText(0, 0, size.width(), size.height(), 0, text);
-            p.end();
-            tex.reset(new QOpenGLTexture(brush));
+        width = std::max(width, raster->width);
+        lines.push_back(Line{raster, nullptr, 0});
+    }
+    int height = lines[0].raster->height;
+    if (lines.size() > 1) {
+        // Laid out as QPainter::drawText() would lay out the whole block
+        const QFontMetrics& fm = GetStringFont(Font, pixelSize).metrics;
+        for (size_t i = 1; i < lines.size(); i++) {
+            lines[i].top = (float)(i * fm.lineSpacing());
         }
-        pobwindow->stringCache.insert(cacheKey, new std::shared_ptr<QOpenGLTexture>(tex));
-    }
-    int width = 0;
-    int height = 0;
-    if (tex.get() != nullptr) {
-        width = tex->width();
-        height = tex->height();
+        height = (int)(lines.size() - 1) * fm.lineSpacing() + fm.height();
     }
+    dscount += (int)lines.size();
 
     switch (Align) {
     case F_CENTRE:
@@ -864,6 +1196,52 @@ DrawStringCmd::DrawStringCmd(float X, float Y, int Align, int Size, int Font, co
     t[3] = 1;
 }
 
+void DrawStringCmd::lineQuad(const Line& line, float lx[4], float ly[4]) const {
+    lx[0] = lx[3] = x[0];
+    lx[1] = lx[2] = x[0] + line.raster->width;
+    ly[0] = ly[1] = y[0] + line.top;
+    ly[2] = ly[3] = y[0] + line.top + line.raster->height;
+}
+
+void DrawStringCmd::execute() {
+    bool pending = false;
+    for (Line& line : lines) {
+        if (!line.tex && !line.raster->isEmpty()) {
+            line.tex = line.raster->texture(!pobwindow->deferText, pobwindow->textureUploader, pobwindow->white);
+            pending |= !line.tex;
+        }
+    }
+    if (pending) {
+        // Still being rasterized; the whole string is drawn on a later frame instead
+        pobwindow->textPending = true;
+        return;
+    }
+    float curCol[4];
+    if (col[3] > 0) {
+        glGetFloatv(GL_CURRENT_COLOR, curCol);
+        glColor4fv(col);
+    }
+    for (const Line& line : lines) {
+        float lx[4], ly[4];
+        lineQuad(line, lx, ly);
+        DrawQuad(line.tex, lx, ly, s, t);
+    }
+    if (col[3] > 0) {
+        glColor4fv(curCol);
+    }
+}
+
+bool DrawStringCmd::capture(DrawList& list) const {
+    // Draw lists are replayed later, so they can't hold a gap for text that isn't ready
+    for (const Line& line : lines) {
+        std::shared_ptr<QOpenGLTexture> texture = line.tex ? line.tex : line.raster->texture(true, pobwindow->textureUploader, pobwindow->white);
+        float lx[4], ly[4];
+        lineQuad(line, lx, ly);
+        list.addQuad(texture, lx, ly, s, t, col[3] > 0 ? col : nullptr);
+    }
+    return true;
+}
+
 static int l_DrawString(lua_State* L)
 {
     pobwindow->LAssert(L, pobwindow->isDrawing, "DrawString() called outside of OnFrame");
@@ -884,6 +1262,16 @@ static int l_DrawString(lua_State* L)
     return 0;
 }
 
+// With deferral on, a string whose pixels aren't ready yet is left out of the frame and the
+// window repaints once it is, instead of waiting for the worker thread
+static int l_SetTextDeferral(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: SetTextDeferral(enabled)");
+    pobwindow->deferText = lua_toboolean(L, 1) != 0;
+    return 0;
+}
+
 static int l_DrawStringWidth(lua_State* L) 
 {
     int n = lua_gettop(L);
@@ -892,24 +1280,25 @@ static int l_DrawStringWidth(lua_State* L)
     pobwindow->LAssert(L, lua_isstring(L, 2), "DrawStringWidth() argument 2: expected string, got %t", 2);
     pobwindow->LAssert(L, lua_isstring(L, 3), "DrawStringWidth() argument 3: expected string, got %t", 3);
     int fontsize = lua_tointeger(L, 1);
-    QString fontName = lua_tostring(L, 2);
+    QLatin1String fontArg = ToLatin1View(L, 2);
+    QString fontName;
     QString fontKey = "0";
-    if (fontName == "VAR") {
+    if (fontArg == QLatin1String("VAR")) {
         fontName = "Liberation Sans";
         fontKey = "1";
-    } else if (fontName == "VAR BOLD") {
+    } else if (fontArg == QLatin1String("VAR BOLD")) {
         fontName = "Liberation Sans Bold";
         fontKey = "2";
     } else {
         fontName = "Bitstream Vera Mono";
     }
-    QString text(lua_tostring(L, 3));
+    QString text = ToQString(L, 3);
 
     text.remove(colourCodes);
 
     QString cacheKey = (fontKey + "_" + QString::number(fontsize) + "_" + text);
-    if (pobwindow->stringCache.contains(cacheKey) && pobwindow->stringCache[cacheKey]->get()) {
-        lua_pushinteger(L, (*pobwindow->stringCache[cacheKey])->width());
+    if (pobwindow->stringCache.contains(cacheKey)) {
+        lua_pushinteger(L, (*pobwindow->stringCache[cacheKey])->width);
         return 1;
     }
 
@@ -931,15 +1320,16 @@ static int l_DrawStringCursorIndex(lua_State* L)
     pobwindow->LAssert(L, lua_isnumber(L, 5), "DrawStringCursorIndex() argument 5: expected number, got %t", 5);
 
     int fontsize = lua_tointeger(L, 1);
-    QString fontName = lua_tostring(L, 2);
-    if (fontName == "VAR") {
+    QLatin1String fontArg = ToLatin1View(L, 2);
+    QString fontName;
+    if (fontArg == QLatin1String("VAR")) {
         fontName = "Liberation Sans";
-    } else if (fontName == "VAR BOLD") {
+    } else if (fontArg == QLatin1String("VAR BOLD")) {
         fontName = "Liberation Sans Bold";
     } else {
         fontName = "Bitstream Vera Mono";
     }
-    QString text(lua_tostring(L, 3));
+    QString text = ToQString(L, 3);
 
     text.remove(colourCodes);
 
@@ -969,27 +1359,177 @@ static int l_StripEscapes(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: StripEscapes(string)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "StripEscapes() argument 1: expected string, got %t", 1);
-    const char* str = lua_tostring(L, 1);
-    char* strip = new char[strlen(str) + 1];
-    char* p = strip;
-    while (*str) {
+    size_t len;
+    const char* str = lua_tolstring(L, 1, &len);
+    const char* end = str + len;
+    // Strings without escapes are returned as they are; otherwise the runs between
+    // escapes are copied straight into a Lua buffer
+    const char* run = str;
+    while (str < end && !IsColorEscape(str)) {
+        str++;
+    }
+    if (str == end) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    while (str < end) {
         int esclen = IsColorEscape(str);
         if (esclen) {
-            str+= esclen;
+            luaL_addlstring(&b, run, str - run);
+            str += esclen;
+            run = str;
         } else {
-            *(p++) = *(str++);
+            str++;
         }
     }
-    *p = 0;
-    lua_pushstring(L, strip);
-    delete[] strip;
+    luaL_addlstring(&b, run, str - run);
+    luaL_pushresult(&b);
     return 1;
 }
 
 static int l_GetAsyncCount(lua_State* L)
 {
-//    lua_pushinteger(L, pobwindow->GetTexAsyncCount());
-    lua_pushinteger(L, 0);
+    lua_pushinteger(L, ImageDecode::pending() + pobwindow->textureUploader.queueDepth());
+    return 1;
+}
+
+// Caps the texture upload work done at the start of each frame; 0 leaves a limit out
+static int l_SetTextureUploadBudget(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: SetTextureUploadBudget(bytes[, ms])");
+    pobwindow->LAssert(L, lua_isnumber(L, 1), "SetTextureUploadBudget() argument 1: expected number, got %t", 1);
+    pobwindow->LAssert(L, n < 2 || lua_isnumber(L, 2), "SetTextureUploadBudget() argument 2: expected number, got %t", 2);
+    qint64 ms = n >= 2 ? (qint64)(lua_tonumber(L, 2) * 1000) : 0;
+    pobwindow->textureUploader.setBudget((qint64)lua_tonumber(L, 1), ms);
+    return 0;
+}
+
+static int l_GetTextureUploadStats(lua_State* L)
+{
+    pobwindow->textureUploader.push(L);
+    return 1;
+}
+
+// ==========
+// Draw Lists
+// ==========
+
+// While a draw list is recording, DrawImage(), DrawImageQuad(), DrawString() and SetDrawColor()
+// go into it instead of the current layer. drawList:Draw() then replays the whole list as one
+// command. Lists are only recorded again when Lua asks, so it has to invalidate them itself.
+
+struct drawListHandle_s {
+    std::shared_ptr<DrawList> *list;
+};
+
+void DrawListCmd::execute() {
+    list->draw(x, y, scale, pobwindow->white.get());
+}
+
+static int l_NewDrawList(lua_State* L)
+{
+    auto handle = (drawListHandle_s*)lua_newuserdata(L, sizeof(drawListHandle_s));
+    handle->list = new std::shared_ptr<DrawList>(std::make_shared<DrawList>());
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static drawListHandle_s* GetDrawListHandle(lua_State* L, const char* method)
+{
+    pobwindow->LAssert(L, pobwindow->IsUserData(L, 1, "uidrawlistmeta"), "drawList:%s() must be used on a draw list", method);
+    auto handle = (drawListHandle_s*)lua_touserdata(L, 1);
+    lua_remove(L, 1);
+    return handle;
+}
+
+// Drops the handle's list, which frees its vertex buffer unless a queued command still holds it
+static void ReleaseDrawList(drawListHandle_s* handle)
+{
+    if (pobwindow->recordingList == *handle->list) {
+        pobwindow->recordingList.reset();
+    }
+    if (!pobwindow->isDrawing) {
+        // The buffer belongs to the window's context
+        pobwindow->makeCurrent();
+    }
+    handle->list->reset();
+}
+
+static int l_drawListGC(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "__gc");
+    ReleaseDrawList(handle);
+    delete handle->list;
+    return 0;
+}
+
+static int l_drawListBeginRecording(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "BeginRecording");
+    pobwindow->LAssert(L, pobwindow->isDrawing, "drawList:BeginRecording() called outside of OnFrame");
+    pobwindow->LAssert(L, !pobwindow->recordingList, "drawList:BeginRecording(): another draw list is already recording");
+    // A fresh list, so anything already queued to draw the old one is unaffected
+    ReleaseDrawList(handle);
+    *handle->list = std::make_shared<DrawList>();
+    (*handle->list)->setColor(pobwindow->drawColor);
+    pobwindow->recordingList = *handle->list;
+    return 0;
+}
+
+// Returns false if something had to be left out, such as an image that was still loading
+static int l_drawListEndRecording(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "EndRecording");
+    pobwindow->LAssert(L, pobwindow->recordingList && pobwindow->recordingList == *handle->list, "drawList:EndRecording(): draw list is not recording");
+    pobwindow->recordingList.reset();
+    (*handle->list)->recorded = true;
+    lua_pushboolean(L, (*handle->list)->complete);
+    return 1;
+}
+
+static int l_drawListDraw(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "Draw");
+    pobwindow->LAssert(L, pobwindow->isDrawing, "drawList:Draw() called outside of OnFrame");
+    pobwindow->LAssert(L, pobwindow->recordingList != *handle->list, "drawList:Draw(): draw list is still recording");
+    int n = lua_gettop(L);
+    float arg[3] = {0.0f, 0.0f, 1.0f};
+    for (int i = 1; i <= 3 && i <= n; i++) {
+        if (!lua_isnil(L, i)) {
+            pobwindow->LAssert(L, lua_isnumber(L, i), "drawList:Draw() argument %d: expected number or nil, got %t", i, i);
+            arg[i-1] = (float)lua_tonumber(L, i);
+        }
+    }
+    if ((*handle->list)->recorded) {
+        pobwindow->AppendCmd(std::make_unique<DrawListCmd>(*handle->list, arg[0], arg[1], arg[2]));
+    }
+    return 0;
+}
+
+static int l_drawListInvalidate(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "Invalidate");
+    ReleaseDrawList(handle);
+    *handle->list = std::make_shared<DrawList>();
+    return 0;
+}
+
+// True once recorded completely and not invalidated since
+static int l_drawListIsValid(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "IsValid");
+    lua_pushboolean(L, (*handle->list)->recorded && (*handle->list)->complete);
+    return 1;
+}
+
+static int l_drawListGetQuadCount(lua_State* L)
+{
+    drawListHandle_s* handle = GetDrawListHandle(L, "GetQuadCount");
+    lua_pushinteger(L, (*handle->list)->quadCount());
     return 1;
 }
 
@@ -997,57 +1537,96 @@ static int l_GetAsyncCount(lua_State* L)
 // Search Handles
 // ==============
 
+// Size/modification time are only looked up when requested. A plain search lists the
+// matching names up front so they come back sorted by name, as they always have; a
+// recursive one walks the tree lazily, in the order the filesystem returns entries
 struct searchHandle_s {
-    QFileInfoList *fil;
+    QDirIterator *it;
+    QStringList *names;
+    int index;
+    QDir *root;
+    bool valid;
 };
 
+static QFileInfo SearchHandleFileInfo(searchHandle_s* handle)
+{
+    return handle->it ? handle->it->fileInfo() : QFileInfo(handle->root->filePath((*handle->names)[handle->index]));
+}
+
 static int l_NewFileSearch(lua_State* L)
 {
     int n = lua_gettop(L);
-    pobwindow->LAssert(L, n >= 1, "Usage: NewFileSearch(spec[, findDirectories])");
+    pobwindow->LAssert(L, n >= 1, "Usage: NewFileSearch(spec[, findDirectories[, recursive]])");
     pobwindow->LAssert(L, lua_isstring(L, 1), "NewFileSearch() argument 1: expected string, got %t", 1);
-    QString search_string(lua_tostring(L, 1));
+    QString search_string = ToQString(L, 1);
     QStringList split = search_string.split("/");
     QString wildcard = split.takeLast();
     QDir dir(split.join("/"));
     QStringList filters;
     filters << wildcard;
     bool dirOnly = lua_toboolean(L, 2) != 0;
-    QFileInfoList fil = dir.entryInfoList(filters, QDir::NoDotAndDotDot | (dirOnly ? QDir::Dirs : QDir::Files));
-    if (fil.isEmpty()) {
-        return 0;
+    bool recursive = lua_toboolean(L, 3) != 0;
+    dir.setNameFilters(filters);
+    dir.setFilter(QDir::NoDotAndDotDot | (dirOnly ? QDir::Dirs : QDir::Files));
+    QDirIterator* it = nullptr;
+    QStringList* names = nullptr;
+    if (recursive) {
+        it = new QDirIterator(dir, QDirIterator::Subdirectories);
+        if (!it->hasNext()) {
+            delete it;
+            return 0;
+        }
+        it->next();
+    } else {
+        names = new QStringList(dir.entryList());
+        if (names->isEmpty()) {
+            delete names;
+            return 0;
+        }
     }
 
     auto handle = (searchHandle_s*)lua_newuserdata(L, sizeof(searchHandle_s));
-    handle->fil = new QFileInfoList(fil);
+    handle->it = it;
+    handle->names = names;
+    handle->index = 0;
+    handle->root = new QDir(dir);
+    handle->valid = true;
     lua_pushvalue(L, lua_upvalueindex(1));
     lua_setmetatable(L, -2);
     return 1;
 }
 
-static QFileInfoList* GetSearchHandle(lua_State* L, const char* method, bool valid)
+static searchHandle_s* GetSearchHandle(lua_State* L, const char* method, bool valid)
 {
     pobwindow->LAssert(L, pobwindow->IsUserData(L, 1, "uisearchhandlemeta"), "searchHandle:%s() must be used on a search handle", method);
     auto searchHandle = (searchHandle_s*)lua_touserdata(L, 1);
     lua_remove(L, 1);
     if (valid) {
-        pobwindow->LAssert(L, !searchHandle->fil->isEmpty(), "searchHandle:%s(): search handle is no longer valid (ran out of files to find)", method);
+        pobwindow->LAssert(L, searchHandle->valid, "searchHandle:%s(): search handle is no longer valid (ran out of files to find)", method);
     }
-    return searchHandle->fil;
+    return searchHandle;
 }
 
 static int l_searchHandleGC(lua_State* L)
 {
-    QFileInfoList* searchHandle = GetSearchHandle(L, "__gc", false);
-    delete searchHandle;
+    searchHandle_s* searchHandle = GetSearchHandle(L, "__gc", false);
+    delete searchHandle->it;
+    delete searchHandle->names;
+    delete searchHandle->root;
     return 0;
 }
 
 static int l_searchHandleNextFile(lua_State* L)
 {
-    QFileInfoList* searchHandle = GetSearchHandle(L, "NextFile", true);
-    searchHandle->removeFirst();
-    if ( searchHandle->isEmpty() ) {
+    searchHandle_s* searchHandle = GetSearchHandle(L, "NextFile", true);
+    if (searchHandle->it) {
+        if (!searchHandle->it->hasNext()) {
+            searchHandle->valid = false;
+            return 0;
+        }
+        searchHandle->it->next();
+    } else if (++searchHandle->index >= searchHandle->names->size()) {
+        searchHandle->valid = false;
         return 0;
     }
     lua_pushboolean(L, 1);
@@ -1056,28 +1635,136 @@ static int l_searchHandleNextFile(lua_State* L)
 
 static int l_searchHandleGetFileName(lua_State* L)
 {
-    QFileInfoList* searchHandle = GetSearchHandle(L, "GetFileName", true);
-    lua_pushstring(L, searchHandle->first().fileName().toStdString().c_str());
+    searchHandle_s* searchHandle = GetSearchHandle(L, "GetFileName", true);
+    // Recursive searches name files relative to the searched directory
+    PushQString(L, searchHandle->it ? searchHandle->root->relativeFilePath(searchHandle->it->filePath()) : (*searchHandle->names)[searchHandle->index]);
     return 1;
 }
 
 static int l_searchHandleGetFileSize(lua_State* L)
 {
-    QFileInfoList* searchHandle = GetSearchHandle(L, "GetFileSize", true);
-    lua_pushinteger(L, searchHandle->first().size());
+    searchHandle_s* searchHandle = GetSearchHandle(L, "GetFileSize", true);
+    lua_pushinteger(L, SearchHandleFileInfo(searchHandle).size());
     return 1;
 }
 
 static int l_searchHandleGetFileModifiedTime(lua_State* L)
 {
-    QFileInfoList* searchHandle = GetSearchHandle(L, "GetFileModifiedTime", true);
-    QDateTime modified = searchHandle->first().lastModified();
+    searchHandle_s* searchHandle = GetSearchHandle(L, "GetFileModifiedTime", true);
+    QDateTime modified = SearchHandleFileInfo(searchHandle).lastModified();
     lua_pushnumber(L, modified.toMSecsSinceEpoch());
-    lua_pushstring(L, modified.date().toString().toStdString().c_str());
-    lua_pushstring(L, modified.time().toString().toStdString().c_str());
+    PushQString(L, modified.date().toString());
+    PushQString(L, modified.time().toString());
     return 3;
 }
 
+// ============
+// Build Index
+// ============
+
+struct buildIndexHandle_s {
+    BuildIndex *index;
+};
+
+static int l_NewBuildIndex(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: NewBuildIndex(path[, headerElem])");
+    pobwindow->LAssert(L, lua_isstring(L, 1), "NewBuildIndex() argument 1: expected string, got %t", 1);
+    pobwindow->LAssert(L, n < 2 || lua_isnil(L, 2) || lua_isstring(L, 2), "NewBuildIndex() argument 2: expected string or nil, got %t", 2);
+    QString headerElem = n >= 2 && lua_isstring(L, 2) ? ToQString(L, 2) : QString();
+    auto handle = (buildIndexHandle_s*)lua_newuserdata(L, sizeof(buildIndexHandle_s));
+    handle->index = new BuildIndex(ToQString(L, 1), headerElem, QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/buildindex");
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_setmetatable(L, -2);
+    return 1;
+}
+
+static BuildIndex* GetBuildIndex(lua_State* L, const char* method)
+{
+    pobwindow->LAssert(L, pobwindow->IsUserData(L, 1, "uibuildindexmeta"), "buildIndex:%s() must be used on a build index", method);
+    auto handle = (buildIndexHandle_s*)lua_touserdata(L, 1);
+    lua_remove(L, 1);
+    return handle->index;
+}
+
+static int l_buildIndexGC(lua_State* L)
+{
+    BuildIndex* index = GetBuildIndex(L, "__gc");
+    delete index;
+    return 0;
+}
+
+static int l_buildIndexGetGeneration(lua_State* L)
+{
+    BuildIndex* index = GetBuildIndex(L, "GetGeneration");
+    lua_pushinteger(L, index->generation);
+    return 1;
+}
+
+static int l_buildIndexRefresh(lua_State* L)
+{
+    BuildIndex* index = GetBuildIndex(L, "Refresh");
+    index->rescan();
+    return 0;
+}
+
+// Lists the files directly inside folder (default: the top of the index), sorted by name:
+// { name, path, size, modified, header = { attribute = value } }
+static int l_buildIndexGetFiles(lua_State* L)
+{
+    BuildIndex* index = GetBuildIndex(L, "GetFiles");
+    QString prefix = lua_isstring(L, 1) ? ToQString(L, 1) : QString();
+    if (!prefix.isEmpty() && !prefix.endsWith("/")) {
+        prefix += "/";
+    }
+    const auto& entries = index->entries();
+    lua_newtable(L);
+    int i = 0;
+    for (auto it = entries.lowerBound(prefix); it != entries.constEnd() && it.key().startsWith(prefix); ++it) {
+        QString name = it.key().mid(prefix.size());
+        if (name.contains('/')) {
+            continue;
+        }
+        lua_createtable(L, 0, 5);
+        PushQString(L, name);
+        lua_setfield(L, -2, "name");
+        PushQString(L, it.key());
+        lua_setfield(L, -2, "path");
+        lua_pushnumber(L, it->size);
+        lua_setfield(L, -2, "size");
+        lua_pushnumber(L, it->modified);
+        lua_setfield(L, -2, "modified");
+        lua_createtable(L, 0, it->header.size());
+        for (auto field = it->header.constBegin(); field != it->header.constEnd(); ++field) {
+            PushQString(L, field.key());
+            PushQString(L, field.value());
+            lua_rawset(L, -3);
+        }
+        lua_setfield(L, -2, "header");
+        lua_rawseti(L, -2, ++i);
+    }
+    return 1;
+}
+
+static int l_buildIndexGetFolders(lua_State* L)
+{
+    BuildIndex* index = GetBuildIndex(L, "GetFolders");
+    QString prefix = lua_isstring(L, 1) ? ToQString(L, 1) : QString();
+    if (!prefix.isEmpty() && !prefix.endsWith("/")) {
+        prefix += "/";
+    }
+    lua_newtable(L);
+    int i = 0;
+    for (const QString& folder : index->folders()) {
+        if (folder.startsWith(prefix) && !folder.mid(prefix.size()).contains('/')) {
+            PushQString(L, folder.mid(prefix.size()));
+            lua_rawseti(L, -2, ++i);
+        }
+    }
+    return 1;
+}
+
 // =================
 // General Functions
 // =================
@@ -1087,14 +1774,13 @@ static int l_SetWindowTitle(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: SetWindowTitle(title)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "SetWindowTitle() argument 1: expected string, got %t", 1);
-    pobwindow->setTitle(lua_tostring(L, 1));
+    pobwindow->setTitle(ToQString(L, 1));
     return 0;
 }
 
 static int l_GetCursorPos(lua_State* L)
 {
-    QPoint pos = QCursor::pos();
-    pos = pobwindow->mapFromGlobal(pos);
+    QPoint pos = pobwindow->cursorPos();
     lua_pushinteger(L, pos.x());
     lua_pushinteger(L, pos.y());
     return 2;
@@ -1123,25 +1809,23 @@ static int l_IsKeyDown(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: IsKeyDown(keyName)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "IsKeyDown() argument 1: expected string, got %t", 1);
-    size_t len;
-    const char* kname = lua_tolstring(L, 1, &len);
-    pobwindow->LAssert(L, len >= 1, "IsKeyDown() argument 1: string is empty", 1);
-    QString k(kname);
+    QLatin1String k = ToLatin1View(L, 1);
+    pobwindow->LAssert(L, k.size() >= 1, "IsKeyDown() argument 1: string is empty", 1);
     bool result = false;
-    if (k == "LEFTBUTTON") {
-        if (QGuiApplication::mouseButtons() & Qt::LeftButton) {
+    if (k == QLatin1String("LEFTBUTTON")) {
+        if (pobwindow->mouseButtons() & Qt::LeftButton) {
             result = true;
         }
     } else {
-        int keys = QGuiApplication::keyboardModifiers();
-        if (k == "CTRL") {
+        int keys = pobwindow->keyboardModifiers();
+        if (k == QLatin1String("CTRL")) {
             result = keys & Qt::ControlModifier;
-        } else if (k == "SHIFT") {
+        } else if (k == QLatin1String("SHIFT")) {
             result = keys & Qt::ShiftModifier;
-        } else if (k == "ALT") {
+        } else if (k == QLatin1String("ALT")) {
             result = keys & Qt::AltModifier;
         } else {
-            std::cout << "UNKNOWN ISKEYDOWN: " << k.toStdString() << std::endl;
+            LogPrintf("UNKNOWN ISKEYDOWN: %.*s", k.size(), k.data());
         }
     }
     lua_pushboolean(L, result);
@@ -1156,7 +1840,7 @@ static int l_Copy(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: Copy(string)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "Copy() argument 1: expected string, got %t", 1);
-    QGuiApplication::clipboard()->setText(lua_tostring(L, 1));
+    QGuiApplication::clipboard()->setText(ToQString(L, 1));
     return 0;
 }
 
@@ -1164,92 +1848,13 @@ static int l_Paste(lua_State* L)
 {
     QString data = QGuiApplication::clipboard()->text();
     if (data.size()) {
-        lua_pushstring(L, data.toStdString().c_str());
+        PushQString(L, data);
         return 1;
     } else {
         return 0;
     }
 }
 
-static int l_Deflate(lua_State* L)
-{
-    int n = lua_gettop(L);
-    pobwindow->LAssert(L, n >= 1, "Usage: Deflate(string)");
-    pobwindow->LAssert(L, lua_isstring(L, 1), "Deflate() argument 1: expected string, got %t", 1);
-    z_stream_s z;
-    z.zalloc = NULL;
-    z.zfree = NULL;
-    deflateInit(&z, 9);
-    size_t inLen;
-    Byte* in = (Byte*)lua_tolstring(L, 1, &inLen);
-    int outSz = deflateBound(&z, inLen);
-    Byte* out = new Byte[outSz];
-    z.next_in = in;
-    z.avail_in = inLen;
-    z.next_out = out;
-    z.avail_out = outSz;
-    int err = deflate(&z, Z_FINISH);
-    deflateEnd(&z);
-    if (err == Z_STREAM_END) {
-        lua_pushlstring(L, (const char*)out, z.total_out);
-        delete[] out;
-        return 1;
-    } else {
-        lua_pushnil(L);
-        lua_pushstring(L, zError(err));
-        delete[] out;
-        return 2;
-    }
-}
-
-static int l_Inflate(lua_State* L)
-{
-    int n = lua_gettop(L);
-    pobwindow->LAssert(L, n >= 1, "Usage: Inflate(string)");
-    pobwindow->LAssert(L, lua_isstring(L, 1), "Inflate() argument 1: expected string, got %t", 1);
-    size_t inLen;
-    Byte* in = (Byte*)lua_tolstring(L, 1, &inLen);
-    int outSz = inLen * 4;
-    Byte* out = new Byte[outSz];
-    z_stream_s z;
-    z.next_in = in;
-    z.avail_in = inLen;
-    z.zalloc = NULL;
-    z.zfree = NULL;
-    z.next_out = out;
-    z.avail_out = outSz;
-    inflateInit(&z);
-    int err;
-    while ((err = inflate(&z, Z_NO_FLUSH)) == Z_OK) {
-        if (z.avail_out == 0) {
-            // Output buffer filled, embiggen it
-            int newSz = outSz << 1;
-            Byte *newOut = (Byte *)realloc(out, newSz);
-            if (newOut) {
-                out = newOut;
-            } else {
-                // PANIC
-                delete[] out;
-                return 0;
-            }
-            z.next_out = out + outSz;
-            z.avail_out = outSz;
-            outSz = newSz;
-        }
-      }
-    inflateEnd(&z);
-    if (err == Z_STREAM_END) {
-        lua_pushlstring(L, (const char*)out, z.total_out);
-        delete[] out;
-        return 1;
-    } else {
-        lua_pushnil(L);
-        lua_pushstring(L, zError(err));
-        delete[] out;
-        return 2;
-    }
-}
-
 static int l_GetTime(lua_State* L)
 {
     qint64 ms = QDateTime::currentDateTime().toMSecsSinceEpoch() - pobwindow->baseTime;
@@ -1259,19 +1864,22 @@ static int l_GetTime(lua_State* L)
 
 static int l_GetScriptPath(lua_State* L)
 {
-    lua_pushstring(L, pobwindow->scriptPath.toStdString().c_str());
+    static Utf8Cache cache;
+    PushByteArray(L, cache.get(pobwindow->scriptPath));
     return 1;
 }
 
 static int l_GetRuntimePath(lua_State* L)
 {
-    lua_pushstring(L, pobwindow->basePath.toStdString().c_str());
+    static Utf8Cache cache;
+    PushByteArray(L, cache.get(pobwindow->basePath));
     return 1;
 }
 
 static int l_GetUserPath(lua_State* L)
 {
-    lua_pushstring(L, pobwindow->userPath.toStdString().c_str());
+    static Utf8Cache cache;
+    PushByteArray(L, cache.get(pobwindow->userPath));
     return 1;
 }
 
@@ -1280,7 +1888,7 @@ static int l_MakeDir(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: MakeDir(path)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "MakeDir() argument 1: expected string, got %t", 1);
-    lua_pushboolean(L, QDir().mkpath(lua_tostring(L, 1)));
+    lua_pushboolean(L, QDir().mkpath(ToQString(L, 1)));
     return 1;
 }
 
@@ -1290,7 +1898,7 @@ static int l_RemoveDir(lua_State* L)
     pobwindow->LAssert(L, n >= 1, "Usage: l_RemoveDir(path)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "l_RemoveDir() argument 1: expected string, got %t", 1);
     QDir d;
-    if (!d.rmdir(lua_tostring(L, 1))) {
+    if (!d.rmdir(ToQString(L, 1))) {
         lua_pushnil(L);
         return 1;
     } else {
@@ -1304,15 +1912,18 @@ static int l_SetWorkDir(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: SetWorkDir(path)");
     pobwindow->LAssert(L, lua_isstring(L, 1), "SetWorkDir() argument 1: expected string, got %t", 1);
-    if (QDir::setCurrent(lua_tostring(L, 1))) {
-        pobwindow->scriptWorkDir = lua_tostring(L, 1);
+    QString path = ToQString(L, 1);
+    if (QDir::setCurrent(path)) {
+        pobwindow->scriptWorkDir = path;
+        pobwindow->workDirUtf8 = QDir::currentPath().toUtf8();
     }
     return 0;
 }
 
 static int l_GetWorkDir(lua_State* L)
 {
-    lua_pushstring(L, QDir::currentPath().toStdString().c_str());
+    // Only SetWorkDir() changes the working directory, and it refreshes this
+    PushByteArray(L, pobwindow->workDirUtf8);
     return 1;
 }
 
@@ -1324,48 +1935,141 @@ static int l_LaunchSubScript(lua_State* L)
         pobwindow->LAssert(L, lua_isstring(L, i), "LaunchSubScript() argument %d: expected string, got %t", i, i);
     }
     for (int i = 4; i <= n; i++) {
-        pobwindow->LAssert(L, lua_isnil(L, i) || lua_isboolean(L, i) || lua_isnumber(L, i) || lua_isstring(L, i), 
-                           "LaunchSubScript() argument %d: only nil, boolean, number and string types can be passed to sub script", i);
-    }
-    int slot = pobwindow->subScriptList.size();
-    pobwindow->subScriptList.append(std::make_shared<SubScript>(L));
-    // Signal us when the subscript completes so we can trigger a repaint.
-    pobwindow->connect( pobwindow->subScriptList[slot].get(), &SubScript::finished, pobwindow, &POBWindow::subScriptFinished );
-    pobwindow->subScriptList[slot]->start();
+        pobwindow->LAssert(L, lua_isnil(L, i) || lua_isboolean(L, i) || lua_isnumber(L, i) || lua_isstring(L, i) || ToBlob(L, i),
+                           "LaunchSubScript() argument %d: only nil, boolean, number, string and blob types can be passed to sub script", i);
+    }
+    int slot = pobwindow->claimSubScriptSlot(nullptr);
+    pobwindow->subScriptList[slot] = std::make_shared<SubScript>(L, slot);
+    pobwindow->subScriptPool.submit(pobwindow->subScriptList[slot]);
     lua_pushinteger(L, slot);
     return 1;
 }
 
+static int l_ParallelMap(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 3, "Usage: ParallelMap(scriptText, inputs, {callback = func[, chunkSize = n][, threads = n]})");
+    pobwindow->LAssert(L, lua_isstring(L, 1), "ParallelMap() argument 1: expected string, got %t", 1);
+    pobwindow->LAssert(L, lua_istable(L, 2), "ParallelMap() argument 2: expected table, got %t", 2);
+    pobwindow->LAssert(L, lua_istable(L, 3), "ParallelMap() argument 3: expected table, got %t", 3);
+    lua_getfield(L, 3, "callback");
+    pobwindow->LAssert(L, lua_isfunction(L, -1), "ParallelMap() options.callback: expected function, got %t", -1);
+    lua_getfield(L, 3, "chunkSize");
+    lua_getfield(L, 3, "threads");
+    int threads = lua_isnumber(L, -1) ? (int)lua_tointeger(L, -1) : QThread::idealThreadCount();
+    int count = (int)lua_objlen(L, 2);
+    int chunkSize = lua_isnumber(L, -2) ? (int)lua_tointeger(L, -2) : (count + threads - 1) / std::max(1, threads);
+    pobwindow->LAssert(L, threads >= 1, "ParallelMap() options.threads: must be at least 1");
+    lua_pop(L, 2);
+    chunkSize = std::max(1, chunkSize);
+
+    size_t len;
+    const char* text = lua_tolstring(L, 1, &len);
+    QByteArray script(text, (int)len);
+    int mapId = pobwindow->nextParallelMapId++;
+    ParallelMap& map = pobwindow->parallelMaps[mapId];
+    map.callbackRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    map.results.resize(count);
+    map.running = 0;
+    for (int first = 1; first <= count; first += chunkSize) {
+        std::vector<SubScriptValue> inputs(std::min(chunkSize, count - first + 1));
+        for (size_t i = 0; i < inputs.size(); i++) {
+            lua_rawgeti(L, 2, first + i);
+            bool ok = ReadSubScriptValue(L, -1, inputs[i]);
+            lua_pop(L, 1);
+            if (!ok) {
+                luaL_unref(L, LUA_REGISTRYINDEX, map.callbackRef);
+                pobwindow->parallelMaps.erase(mapId);
+                pobwindow->LAssert(L, 0, "ParallelMap() input %d: only nil, boolean, number, string and blob types can be passed to sub script", first + (int)i);
+            }
+        }
+        map.chunks.push_back(std::make_shared<SubScript>(script, std::move(inputs), mapId, first));
+    }
+    map.nextChunk = 0;
+    while (map.running < threads && map.nextChunk < map.chunks.size()) {
+        pobwindow->subScriptPool.submit(map.chunks[map.nextChunk++]);
+        map.running++;
+    }
+    if (map.running == 0) {
+        // Nothing to do; still answer through the callback, but from the event loop, since posting
+        // here would deliver it synchronously before ParallelMap() has returned the map ID
+        map.running = 1;
+        auto job = std::make_shared<SubScript>(script, std::vector<SubScriptValue>(), mapId, 1);
+        QMetaObject::invokeMethod(&pobwindow->subScriptPool, [job]() {
+            pobwindow->subScriptPool.postFinished(job);
+        }, Qt::QueuedConnection);
+    }
+    lua_pushinteger(L, mapId);
+    return 1;
+}
+
+static int l_AbortParallelMap(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: AbortParallelMap(mapID)");
+    pobwindow->LAssert(L, lua_isnumber(L, 1), "AbortParallelMap() argument 1: expected map ID, got %t", 1);
+    auto it = pobwindow->parallelMaps.find((int)lua_tointeger(L, 1));
+    if (it == pobwindow->parallelMaps.end()) {
+        return 0;
+    }
+    for (auto& job : it->second.chunks) {
+        pobwindow->subScriptPool.abort(job);
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, it->second.callbackRef);
+    pobwindow->parallelMaps.erase(it);
+    return 0;
+}
+
+static int l_SetSubScriptCacheDir(lua_State* L)
+{
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: SetSubScriptCacheDir({path|nil})");
+    pobwindow->LAssert(L, lua_isstring(L, 1) || lua_isnil(L, 1), "SetSubScriptCacheDir() argument 1: expected string or nil, got %t", 1);
+    pobwindow->subScriptPool.cache.setDir(lua_isnil(L, 1) ? QString() : QString(lua_tostring(L, 1)));
+    return 0;
+}
+
+static int l_GetSubScriptCacheStats(lua_State* L)
+{
+    lua_pushinteger(L, pobwindow->subScriptPool.cache.hits);
+    lua_pushinteger(L, pobwindow->subScriptPool.cache.misses);
+    return 2;
+}
+
+static int l_SetSubScriptPreload(lua_State* L)
+{
+    int n = lua_gettop(L);
+    QStringList modules;
+    for (int i = 1; i <= n; i++) {
+        pobwindow->LAssert(L, lua_isstring(L, i), "SetSubScriptPreload() argument %d: expected string, got %t", i, i);
+        modules << lua_tostring(L, i);
+    }
+    pobwindow->subScriptPool.setPreload(modules);
+    return 0;
+}
+
 static int l_AbortSubScript(lua_State* L)
 {
-    std::cout << "SUBSCRIPT ABORT STUB" << std::endl;
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: AbortSubScript(ssID)");
+    pobwindow->LAssert(L, lua_isnumber(L, 1), "AbortSubScript() argument 1: expected subscript ID, got %t", 1);
+    int slot = (int)lua_tointeger(L, 1);
+    pobwindow->LAssert(L, slot >= 0 && slot < pobwindow->subScriptList.size() && pobwindow->subScriptList[slot], "AbortSubScript() argument 1: invalid subscript ID");
+    pobwindow->subScriptPool.abort(pobwindow->subScriptList[slot]);
+    pobwindow->releaseSubScriptSlot(slot);
     return 0;
-    /*
-        int n = lua_gettop(L);
-      pobwindow->LAssert(L, n >= 1, "Usage: AbortSubScript(ssID)");
-      pobwindow->LAssert(L, lua_islightuserdata(L, 1), "AbortSubScript() argument 1: expected subscript ID, got %t", 1);
-      notdword slot = (notdword)lua_touserdata(L, 1);
-      pobwindow->LAssert(L, slot < pobwindow->subScriptSize && pobwindow->subScriptList[slot], "AbortSubScript() argument 1: invalid subscript ID");
-      pobwindow->LAssert(L, pobwindow->subScriptList[slot]->IsRunning(), "AbortSubScript(): subscript isn't running");
-      ui_ISubScript::FreeHandle(pobwindow->subScriptList[slot]);
-      pobwindow->subScriptList[slot] = NULL;
-      return 0;
-    */
 }
 
 static int l_IsSubScriptRunning(lua_State* L)
 {
-    std::cout << "SUBSCRIPT RUNNING STUB" << std::endl;
-    return 0;
-    /*
-        int n = lua_gettop(L);
-      pobwindow->LAssert(L, n >= 1, "Usage: IsSubScriptRunning(ssID)");
-      pobwindow->LAssert(L, lua_islightuserdata(L, 1), "IsSubScriptRunning() argument 1: expected subscript ID, got %t", 1);
-      notdword slot = (notdword)lua_touserdata(L, 1);
-      pobwindow->LAssert(L, slot < pobwindow->subScriptSize && pobwindow->subScriptList[slot], "IsSubScriptRunning() argument 1: invalid subscript ID");
-      lua_pushboolean(L, pobwindow->subScriptList[slot]->IsRunning());
-      return 1;
-    */
+    int n = lua_gettop(L);
+    pobwindow->LAssert(L, n >= 1, "Usage: IsSubScriptRunning(ssID)");
+    pobwindow->LAssert(L, lua_isnumber(L, 1), "IsSubScriptRunning() argument 1: expected subscript ID, got %t", 1);
+    int slot = (int)lua_tointeger(L, 1);
+    pobwindow->LAssert(L, slot >= 0, "IsSubScriptRunning() argument 1: invalid subscript ID");
+    // Finished and aborted subscripts have had their slot reclaimed
+    lua_pushboolean(L, slot < pobwindow->subScriptList.size() && pobwindow->subScriptList[slot] && !pobwindow->subScriptList[slot]->isFinished());
+    return 1;
 }
 
 static int l_LoadModule(lua_State* L)
@@ -1373,13 +2077,11 @@ static int l_LoadModule(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: LoadModule(name[, ...])");
     pobwindow->LAssert(L, lua_isstring(L, 1), "LoadModule() argument 1: expected string, got %t", 1);
-    QString fileName(lua_tostring(L, 1));
+    QString fileName = ToQString(L, 1);
     if (!fileName.endsWith(".lua")) {
         fileName = fileName + ".lua";
     }
-    QDir::setCurrent(pobwindow->scriptPath);
-    int err = luaL_loadfile(L, fileName.toStdString().c_str());
-    QDir::setCurrent(pobwindow->scriptWorkDir);
+    int err = pobwindow->moduleCache.load(L, pobwindow->scriptPath, fileName);
     pobwindow->LAssert(L, err == 0, "LoadModule() error loading '%s':\n%s", fileName.toStdString().c_str(), lua_tostring(L, -1));
     lua_replace(L, 1);	// Replace module name with module main chunk
     lua_call(L, n - 1, LUA_MULTRET);
@@ -1391,13 +2093,11 @@ static int l_PLoadModule(lua_State* L)
     int n = lua_gettop(L);
     pobwindow->LAssert(L, n >= 1, "Usage: PLoadModule(name[, ...])");
     pobwindow->LAssert(L, lua_isstring(L, 1), "PLoadModule() argument 1: expected string, got %t", 1);
-    QString fileName(lua_tostring(L, 1));
+    QString fileName = ToQString(L, 1);
     if (!fileName.endsWith(".lua")) {
         fileName = fileName + ".lua";
     }
-    QDir::setCurrent(pobwindow->scriptPath);
-    int err = luaL_loadfile(L, fileName.toStdString().c_str());
-    QDir::setCurrent(pobwindow->scriptWorkDir);
+    int err = pobwindow->moduleCache.load(L, pobwindow->scriptPath, fileName);
     if (err) {
         return 1;
     }
@@ -1440,11 +2140,21 @@ static int l_ConPrintf(lua_State* L)
     lua_insert(L, 1);
     lua_call(L, n, 1);
     pobwindow->LAssert(L, lua_isstring(L, 1), "ConPrintf() error: string.format returned non-string");
-    //std::cout << lua_tostring(L, 1) << std::endl;
-    //pobwindow->sys->con->Printf("%s\n", lua_tostring(L, 1));
+    size_t len;
+    const char* str = lua_tolstring(L, 1, &len);
+    Logger::instance().write(str, len);
     return 0;
 }
 
+// Lines written to the log so far, and lines dropped because its buffer was full
+static int l_GetLogStats(lua_State* L)
+{
+    Logger& logger = Logger::instance();
+    lua_pushnumber(L, (lua_Number)logger.writtenCount());
+    lua_pushnumber(L, (lua_Number)logger.droppedCount());
+    return 2;
+}
+
 static void printTableItter(lua_State* L, int index, int level, bool recurse)
 {
     lua_checkstack(L, 5);
@@ -1530,18 +2240,32 @@ static int l_ConClear(lua_State* L)
 static int l_print(lua_State* L)
 {
     int n = lua_gettop(L);
+    lua_checkstack(L, n + 2);
     lua_getglobal(L, "tostring");
+    // Every argument is converted before the line is queued, so nothing can throw while a log slot is held
+    size_t total = n > 1 ? n - 1 : 0;
     for (int i = 1; i <= n; i++) {
-        lua_pushvalue(L, -1);	// Push tostring function
+        lua_pushvalue(L, n + 1);	// Push tostring function
         lua_pushvalue(L, i);
         lua_call(L, 1, 1);		// Call tostring
-        const char* s = lua_tostring(L, -1);
+        size_t len;
+        const char* s = lua_tolstring(L, -1, &len);
         pobwindow->LAssert(L, s != NULL, "print() error: tostring returned non-string");
-        if (i > 1) std::cout << " ";
-        std::cout << s;
-        lua_pop(L, 1);			// Pop result of tostring
+        total += len;
     }
-    std::cout << std::endl;
+    Logger::instance().write(total, [L, n](char* dest, size_t destLen) {
+        char* end = dest + destLen;
+        for (int i = 1; i <= n && dest < end; i++) {
+            if (i > 1) {
+                *dest++ = ' ';
+            }
+            size_t len;
+            const char* s = lua_tolstring(L, n + 1 + i, &len);
+            len = std::min(len, (size_t)(end - dest));
+            memcpy(dest, s, len);
+            dest += len;
+        }
+    });
     return 0;
 }
 
@@ -1600,27 +2324,9 @@ static int l_Exit(lua_State* L)
 #define ADDFUNC(n) lua_pushcclosure(L, l_##n, 0);lua_setglobal(L, #n);
 #define ADDFUNCCL(n, u) lua_pushcclosure(L, l_##n, u);lua_setglobal(L, #n);
 
-int main(int argc, char **argv)
+// Registers every native with the main state; shared with the benchmark target
+void RegisterNatives()
 {
-    QGuiApplication app{argc, argv};
-
-    QStringList args = app.arguments();
-
-    pobwindow = new POBWindow;
-
-    if (args.size() > 1) {
-        bool ok;
-        int ff = args[1].toInt(&ok);
-        if (ok) {
-            pobwindow->fontFudge = ff;
-            args.removeAt(1); // Remove our hacky font factor from the arglist passed on to the script
-        }
-    }
-
-    L = luaL_newstate();
-    luaL_openlibs(L);
-    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
-
     // Callbacks
     lua_newtable(L);		// Callbacks table
     lua_pushvalue(L, -1);	// Push callbacks table
@@ -1630,6 +2336,9 @@ int main(int argc, char **argv)
     lua_pushvalue(L, -1);	// Push callbacks table
     ADDFUNCCL(SetMainObject, 1);
     lua_setfield(L, LUA_REGISTRYINDEX, "uicallbacks");
+    ADDFUNC(SetInputBatching);
+    ADDFUNC(SetGCScheduling);
+    ADDFUNC(GetGCStats);
 
     // Image handles
     lua_newtable(L);		// Image handle metatable
@@ -1653,6 +2362,28 @@ int main(int argc, char **argv)
     lua_setfield(L, -2, "ImageSize");
     lua_setfield(L, LUA_REGISTRYINDEX, "uiimghandlemeta");
 
+    // Draw lists
+    lua_newtable(L);		// Draw list metatable
+    lua_pushvalue(L, -1);	// Push draw list metatable
+    ADDFUNCCL(NewDrawList, 1);
+    lua_pushvalue(L, -1);	// Push draw list metatable
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_drawListGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_drawListBeginRecording);
+    lua_setfield(L, -2, "BeginRecording");
+    lua_pushcfunction(L, l_drawListEndRecording);
+    lua_setfield(L, -2, "EndRecording");
+    lua_pushcfunction(L, l_drawListDraw);
+    lua_setfield(L, -2, "Draw");
+    lua_pushcfunction(L, l_drawListInvalidate);
+    lua_setfield(L, -2, "Invalidate");
+    lua_pushcfunction(L, l_drawListIsValid);
+    lua_setfield(L, -2, "IsValid");
+    lua_pushcfunction(L, l_drawListGetQuadCount);
+    lua_setfield(L, -2, "GetQuadCount");
+    lua_setfield(L, LUA_REGISTRYINDEX, "uidrawlistmeta");
+
     // Rendering
     ADDFUNC(RenderInit);
     ADDFUNC(GetScreenSize);
@@ -1665,8 +2396,11 @@ int main(int argc, char **argv)
     ADDFUNC(DrawString);
     ADDFUNC(DrawStringWidth);
     ADDFUNC(DrawStringCursorIndex);
+    ADDFUNC(SetTextDeferral);
     ADDFUNC(StripEscapes);
     ADDFUNC(GetAsyncCount);
+    ADDFUNC(SetTextureUploadBudget);
+    ADDFUNC(GetTextureUploadStats);
 
     // Search handles
     lua_newtable(L);	// Search handle metatable
@@ -1686,6 +2420,32 @@ int main(int argc, char **argv)
     lua_setfield(L, -2, "GetFileModifiedTime");
     lua_setfield(L, LUA_REGISTRYINDEX, "uisearchhandlemeta");
 
+    // Build index handles
+    lua_newtable(L);	// Build index metatable
+    lua_pushvalue(L, -1);	// Push build index metatable
+    ADDFUNCCL(NewBuildIndex, 1);
+    lua_pushvalue(L, -1);	// Push build index metatable
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_buildIndexGC);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, l_buildIndexGetGeneration);
+    lua_setfield(L, -2, "GetGeneration");
+    lua_pushcfunction(L, l_buildIndexRefresh);
+    lua_setfield(L, -2, "Refresh");
+    lua_pushcfunction(L, l_buildIndexGetFiles);
+    lua_setfield(L, -2, "GetFiles");
+    lua_pushcfunction(L, l_buildIndexGetFolders);
+    lua_setfield(L, -2, "GetFolders");
+    lua_setfield(L, LUA_REGISTRYINDEX, "uibuildindexmeta");
+
+    // Blobs
+    RegisterBlob(L);
+    RegisterCompress(L);
+    RegisterBuildCode(L);
+    RegisterXML(L);
+    RegisterDataPack(L);
+    RegisterAllocStats(L, &luaAllocator);
+
     // General function
     ADDFUNC(SetWindowTitle);
     ADDFUNC(GetCursorPos);
@@ -1694,8 +2454,6 @@ int main(int argc, char **argv)
     ADDFUNC(IsKeyDown);
     ADDFUNC(Copy);
     ADDFUNC(Paste);
-    ADDFUNC(Deflate);
-    ADDFUNC(Inflate);
     ADDFUNC(GetTime);
     ADDFUNC(GetScriptPath);
     ADDFUNC(GetRuntimePath);
@@ -1707,6 +2465,11 @@ int main(int argc, char **argv)
     ADDFUNC(LaunchSubScript);
     ADDFUNC(AbortSubScript);
     ADDFUNC(IsSubScriptRunning);
+    ADDFUNC(SetSubScriptPreload);
+    ADDFUNC(SetSubScriptCacheDir);
+    ADDFUNC(GetSubScriptCacheStats);
+    ADDFUNC(ParallelMap);
+    ADDFUNC(AbortParallelMap);
     ADDFUNC(LoadModule);
     ADDFUNC(PLoadModule);
     ADDFUNC(PCall);
@@ -1717,6 +2480,7 @@ int main(int argc, char **argv)
     ADDFUNC(ConPrintTable);
     ADDFUNC(ConExecute);
     ADDFUNC(ConClear);
+    ADDFUNC(GetLogStats);
     ADDFUNC(print);
     ADDFUNC(SpawnProcess);
     ADDFUNC(OpenURL);
@@ -1727,30 +2491,143 @@ int main(int argc, char **argv)
     lua_pushcfunction(L, l_Exit);
     lua_setfield(L, -2, "exit");
     lua_pop(L, 1);		// Pop 'os' table
+}
+
+#ifndef POBFRONTEND_NO_MAIN
+int main(int argc, char **argv)
+{
+    // --headless has to pick the platform plugin before the application exists. Drawing
+    // still needs an OpenGL context, so the offscreen plugin must have been built with GLX or EGL.
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--headless") && !qEnvironmentVariableIsSet("QT_QPA_PLATFORM")) {
+            qputenv("QT_QPA_PLATFORM", "offscreen");
+        }
+    }
+
+    QGuiApplication app{argc, argv};
+
+    QStringList args = app.arguments();
+
+    pobwindow = new POBWindow;
+
+    if (args.removeAll("--startup-report") > 0) {
+        pobwindow->startupReport.enabled = true;
+    }
+    args.removeAll("--headless");
+
+    // --record <file> logs the session's input; --replay <file> plays a log back at its
+    // recorded window size and prints frame time percentiles when it runs out
+    auto takeOption = [&args](const QString& name) {
+        int i = args.indexOf(name);
+        if (i < 1 || i + 1 >= args.size()) {
+            return QString();
+        }
+        QString value = args[i + 1];
+        args.removeAt(i);
+        args.removeAt(i);
+        return value;
+    };
+    // --log-file <file> sends print(), ConPrintf() and diagnostics to a rotating file instead of stderr
+    QString logPath = takeOption("--log-file");
+    if (!logPath.isEmpty() && !Logger::instance().openFile(logPath)) {
+        LogPrintf("Log: can't open %s", logPath.toUtf8().constData());
+    }
+    QString recordPath = takeOption("--record");
+    QString replayPath = takeOption("--replay");
+    if (!replayPath.isEmpty()) {
+        QByteArray error = pobwindow->inputReplay.load(replayPath);
+        if (!error.isEmpty()) {
+            LogPrintf("Replay: %s", error.constData());
+            return 1;
+        }
+    }
+
+    if (args.size() > 1) {
+        bool ok;
+        int ff = args[1].toInt(&ok);
+        if (ok) {
+            pobwindow->fontFudge = ff;
+            args.removeAt(1); // Remove our hacky font factor from the arglist passed on to the script
+        }
+    }
+
+    L = luaAllocator.newState();
+    luaL_openlibs(L);
+    luaJIT_setmode(L, 0, LUAJIT_MODE_ENGINE|LUAJIT_MODE_OFF);
+
+    RegisterNatives();
 
     // Set up args table
     lua_createtable(L, args.size() - 1, 1);
     for (int i = 0; i < args.size(); i++) {
-        lua_pushstring(L, args[i].toStdString().c_str());
+        PushQString(L, args[i]);
         lua_rawseti(L, -2, i);
     }
     lua_setglobal(L, "arg");
 
+    // Independent startup work runs side by side: font files are read and modules
+    // precompiled in the background while the window and GL context come up.
+    // LoadModule() is safe to call while the precompile is still running.
+    StartupReport& report = pobwindow->startupReport;
+    report.begin("fonts");
+    auto fontData = std::async(std::launch::async, []() {
+        std::vector<QByteArray> fonts;
+        for (const char* name : {"VeraMono.ttf", "LiberationSans-Regular.ttf", "LiberationSans-Bold.ttf"}) {
+            QFile file(name);
+            if (file.open(QFile::ReadOnly)) {
+                fonts.push_back(file.readAll());
+            }
+        }
+        return fonts;
+    });
+
+    report.begin("modules");
+    pobwindow->moduleCache.setDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + "/modules");
+    auto precompile = std::async(std::launch::async, [&report]() {
+        pobwindow->moduleCache.precompile(pobwindow->scriptPath);
+        report.end("modules", QString("%1 compiled, %2 up to date").arg(pobwindow->moduleCache.compiled.load()).arg(pobwindow->moduleCache.upToDate.load()));
+    });
+
+    if (pobwindow->inputReplay.isActive()) {
+        QSize size(pobwindow->inputReplay.width, pobwindow->inputReplay.height);
+        pobwindow->setMinimumSize(size);
+        pobwindow->setMaximumSize(size);
+        pobwindow->resize(size);
+    } else {
+        pobwindow->resize(800, 600);
+    }
+    pobwindow->show();
+    if (!recordPath.isEmpty() && !pobwindow->inputRecorder.open(recordPath, pobwindow->size().width(), pobwindow->size().height())) {
+        LogPrintf("Record: can't open %s", recordPath.toUtf8().constData());
+    }
+    app.processEvents(QEventLoop::ExcludeUserInputEvents);
+
+    // QFontDatabase may only be used from the GUI thread
+    for (const QByteArray& font : fontData.get()) {
+        QFontDatabase::addApplicationFontFromData(font);
+    }
+    report.end("fonts");
+
+    report.begin("launch");
     int result = luaL_dofile(L, "Launch.lua");
     if (result != 0) {
         lua_error(L);
     }
+    report.end("launch");
 
+    report.begin("init");
     pushCallback("OnInit");
     result = lua_pcall(L, 1, 0, 0);
     if (result != 0) {
         lua_error(L);
     }
-    pobwindow->resize(800, 600);
-    pobwindow->show();
-    QFontDatabase::addApplicationFont("VeraMono.ttf");
-    QFontDatabase::addApplicationFont("LiberationSans-Regular.ttf");
-    QFontDatabase::addApplicationFont("LiberationSans-Bold.ttf");
-    return app.exec();
+    report.end("init", QString("%1 images decoding").arg(ImageDecode::pending().load()));
+    pobwindow->gcScheduler.start(L);
+    pobwindow->luaReady = true;
+    pobwindow->update();
+    int ret = app.exec();
+    pobwindow->inputRecorder.close();
+    precompile.wait();
+    return ret;
 }
-
+#endif
@@ -6,6 +6,7 @@
 #include <QtCore/qmath.h>
 
 #include <memory>
+#include <vector>
 
 // Font alignment
 enum r_fontAlign_e {
@@ -32,10 +33,17 @@ enum r_texFlag_e {
 	TF_ASYNC	= 0x08	// Asynchronous loading
 };
 
+class DrawList;
+class TextRaster;
+
 class Cmd {
   public:
     virtual ~Cmd() = default;
     virtual void execute() = 0;
+    // Adds the command to a recording draw list instead; commands that can't be recorded return false and are drawn as usual
+    virtual bool capture(DrawList&) const {
+        return false;
+    }
 };
 
 class ViewportCmd : public Cmd {
@@ -54,6 +62,7 @@ class ColorCmd : public Cmd {
     void execute() {
         glColor4fv(col);
     }
+    bool capture(DrawList& list) const;
   private:
     float col[4];
 };
@@ -65,6 +74,7 @@ class DrawImageQuadCmd : public Cmd {
     }
 
     void execute();
+    bool capture(DrawList& list) const;
   protected:
     std::shared_ptr<QOpenGLTexture> tex;
     float x[4];
@@ -85,17 +95,8 @@ class DrawStringCmd : public DrawImageQuadCmd {
     ~DrawStringCmd() {
     }
 
-    void execute() {
-        float curCol[4];
-        if (col[3] > 0) {
-            glGetFloatv(GL_CURRENT_COLOR, curCol);
-            glColor4fv(col);
-        }
-        DrawImageQuadCmd::execute();
-        if (col[3] > 0) {
-            glColor4fv(curCol);
-        }
-    }
+    void execute();
+    bool capture(DrawList& list) const;
 
     void setCol(float c0, float c1, float c2) {
         col[0] = c0;
@@ -104,7 +105,30 @@ class DrawStringCmd : public DrawImageQuadCmd {
         col[3] = 1.0f;
     }
   private:
+    // Each line of the text is cached and rasterized on its own, so changing one line of a
+    // tooltip only redraws that line. The texture is taken from the raster when the command
+    // executes, as the pixels may still be in progress.
+    struct Line {
+        std::shared_ptr<TextRaster> raster;
+        std::shared_ptr<QOpenGLTexture> tex;
+        float top;
+    };
+
+    void lineQuad(const Line& line, float lx[4], float ly[4]) const;
+
     float col[4];
     QString text;
+    std::vector<Line> lines;
+};
+
+class DrawListCmd : public Cmd {
+  public:
+    DrawListCmd(std::shared_ptr<DrawList> List, float X, float Y, float Scale) : list(List), x(X), y(Y), scale(Scale) {
+    }
+
+    void execute();
+  private:
+    std::shared_ptr<DrawList> list;
+    float x, y, scale;
 };
 #endif
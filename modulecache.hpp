@@ -0,0 +1,256 @@
+#ifndef MODULECACHE_HPP
+#define MODULECACHE_HPP
+
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QMutex>
+#include <QSaveFile>
+#include <QRunnable>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+
+#include <atomic>
+
+#include "bytecode.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lualib.h"
+    #include "lauxlib.h"
+    #include "luajit.h"
+}
+
+// Precompiled LoadModule()/PLoadModule() chunks, keyed by path and validated
+// against the LuaJIT version and the source file's mtime and size. Each module
+// is kept on disk as <dir>/<sha1 of path>.luac: LUAJIT_VERSION_NUM, mtime, size,
+// then the bytecode. Bytecode is only held in memory until its first load.
+class ModuleCache {
+public:
+    ModuleCache() : compiled(0), upToDate(0), precompileMs(0) {}
+
+    void setDir(const QString& path) {
+        dir = path;
+        QDir().mkpath(dir);
+    }
+
+    // Brings the modules loaded by earlier runs up to date, compiling stale ones on worker
+    // threads with a throwaway lua_State each. They're listed in <dir>/modules.txt, so
+    // scripts that are never loaded, such as unused data files, aren't compiled.
+    void precompile(const QString& root) {
+        QElapsedTimer timer;
+        timer.start();
+        QThreadPool threads;
+        QFile manifest(manifestPath());
+        if (!dir.isEmpty() && manifest.open(QFile::ReadOnly)) {
+            QSet<QString> seen;
+            for (const QByteArray& line : manifest.readAll().split('\n')) {
+                QString chunkName = QString::fromUtf8(line.trimmed());
+                if (chunkName.isEmpty() || seen.contains(chunkName)) {
+                    continue;
+                }
+                seen.insert(chunkName);
+                QString path = QDir(root).filePath(chunkName);
+                if (QFileInfo::exists(path)) {
+                    threads.start(new Precompile(this, path, chunkName));
+                }
+            }
+        }
+        threads.waitForDone();
+        precompileMs = timer.elapsed();
+    }
+
+    // Like luaL_loadfile(), but fileName is resolved against root without touching the working directory
+    int load(lua_State* L, const QString& root, const QString& fileName) {
+        QString path = QDir::isAbsolutePath(fileName) ? fileName : QDir(root).filePath(fileName);
+        QFileInfo info(path);
+        if (!info.exists()) {
+            return luaL_loadfile(L, path.toStdString().c_str());
+        }
+        QByteArray chunkName = "@" + fileName.toUtf8();
+        QByteArray bytecode;
+        if (!QDir::isAbsolutePath(fileName)) {
+            record(fileName);
+        }
+        if (find(path, info, bytecode, false)) {
+            if (luaL_loadbuffer(L, bytecode.constData(), bytecode.size(), chunkName.constData()) == 0) {
+                return 0;
+            }
+            // Truncated, or otherwise unloadable; rebuilt from source below
+            lua_pop(L, 1);
+            evict(path);
+            bytecode.clear();
+        }
+        QFile source(path);
+        if (!source.open(QFile::ReadOnly)) {
+            return luaL_loadfile(L, path.toStdString().c_str());
+        }
+        QByteArray text = source.readAll();
+        int err = luaL_loadbuffer(L, text.constData(), text.size(), chunkName.constData());
+        if (err == 0) {
+            lua_dump(L, BytecodeWriter, &bytecode);
+            store(path, info, bytecode, false);
+        }
+        return err;
+    }
+
+    std::atomic<int> compiled;
+    std::atomic<int> upToDate;
+    qint64 precompileMs;
+
+private:
+    struct Entry {
+        qint64 mtime;
+        qint64 size;
+        QByteArray bytecode;
+    };
+
+    class Precompile : public QRunnable {
+    public:
+        Precompile(ModuleCache* Cache, const QString& Path, const QString& ChunkName) : cache(Cache), path(Path), chunkName(ChunkName) {}
+
+        void run() override {
+            QFileInfo info(path);
+            QByteArray bytecode;
+            if (cache->find(path, info, bytecode, true)) {
+                cache->upToDate++;
+                return;
+            }
+            QFile source(path);
+            if (!source.open(QFile::ReadOnly)) {
+                return;
+            }
+            QByteArray text = source.readAll();
+            lua_State* L = luaL_newstate();
+            if (!L) {
+                return;
+            }
+            QByteArray name = "@" + chunkName.toUtf8();
+            if (luaL_loadbuffer(L, text.constData(), text.size(), name.constData()) == 0) {
+                lua_dump(L, BytecodeWriter, &bytecode);
+                cache->store(path, info, bytecode, true);
+                cache->compiled++;
+            }
+            lua_close(L);
+        }
+    private:
+        ModuleCache* cache;
+        QString path;
+        QString chunkName;
+    };
+
+    QString diskPath(const QString& path) {
+        return QDir(dir).filePath(QString::fromLatin1(QCryptographicHash::hash(path.toUtf8(), QCryptographicHash::Sha1).toHex()) + ".luac");
+    }
+
+    QString manifestPath() const {
+        return QDir(dir).filePath("modules.txt");
+    }
+
+    // Adds a module to the list precompile() works from on the next run
+    void record(const QString& chunkName) {
+        if (dir.isEmpty()) {
+            return;
+        }
+        QMutexLocker lock(&mutex);
+        if (recorded.isEmpty()) {
+            QFile manifest(manifestPath());
+            if (manifest.open(QFile::ReadOnly)) {
+                for (const QByteArray& line : manifest.readAll().split('\n')) {
+                    recorded.insert(QString::fromUtf8(line.trimmed()));
+                }
+            }
+        }
+        if (recorded.contains(chunkName)) {
+            return;
+        }
+        recorded.insert(chunkName);
+        QFile manifest(manifestPath());
+        if (manifest.open(QFile::WriteOnly | QFile::Append)) {
+            manifest.write(chunkName.toUtf8() + "\n");
+        }
+    }
+
+    // Precompiled bytecode is kept in memory for the load that follows; a load takes it out again
+    bool find(const QString& path, const QFileInfo& info, QByteArray& bytecode, bool keep) {
+        qint64 mtime = info.lastModified().toMSecsSinceEpoch();
+        {
+            QMutexLocker lock(&mutex);
+            auto it = entries.find(path);
+            if (it != entries.end()) {
+                bool valid = it->mtime == mtime && it->size == info.size();
+                if (valid) {
+                    bytecode = it->bytecode;
+                }
+                if (!keep || !valid) {
+                    entries.erase(it);
+                }
+                if (valid) {
+                    return true;
+                }
+            }
+        }
+        if (dir.isEmpty()) {
+            return false;
+        }
+        QFile file(diskPath(path));
+        if (!file.open(QFile::ReadOnly)) {
+            return false;
+        }
+        QDataStream in(&file);
+        qint32 version = 0;
+        Entry entry;
+        in >> version >> entry.mtime >> entry.size >> entry.bytecode;
+        if (in.status() != QDataStream::Ok || version != LUAJIT_VERSION_NUM || entry.mtime != mtime || entry.size != info.size()) {
+            return false;
+        }
+        bytecode = entry.bytecode;
+        if (keep) {
+            QMutexLocker lock(&mutex);
+            entries.insert(path, entry);
+        }
+        return true;
+    }
+
+    void store(const QString& path, const QFileInfo& info, const QByteArray& bytecode, bool keep) {
+        Entry entry{info.lastModified().toMSecsSinceEpoch(), info.size(), bytecode};
+        if (keep) {
+            QMutexLocker lock(&mutex);
+            entries.insert(path, entry);
+        }
+        if (dir.isEmpty()) {
+            return;
+        }
+        // LoadModule() may store the same module as a precompile worker, so each writer gets its own temporary file
+        QSaveFile file(diskPath(path));
+        if (file.open(QFile::WriteOnly)) {
+            QDataStream out(&file);
+            out << (qint32)LUAJIT_VERSION_NUM << entry.mtime << entry.size << entry.bytecode;
+            file.commit();
+        }
+    }
+
+    void evict(const QString& path) {
+        {
+            QMutexLocker lock(&mutex);
+            entries.remove(path);
+        }
+        if (!dir.isEmpty()) {
+            QFile::remove(diskPath(path));
+        }
+    }
+
+    QString dir;
+    QMutex mutex;
+    QHash<QString, Entry> entries;
+    QSet<QString> recorded;
+};
+
+#endif
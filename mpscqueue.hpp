@@ -0,0 +1,57 @@
+#ifndef MPSCQUEUE_HPP
+#define MPSCQUEUE_HPP
+
+#include <atomic>
+#include <utility>
+
+// Lock-free queue for many producer threads and a single consumer.
+// Producers push onto an intrusive stack with one CAS; the consumer takes the
+// whole stack with one exchange and reverses it to get arrival order back.
+template <typename T>
+class MPSCQueue {
+public:
+    MPSCQueue() : head(nullptr) {}
+    MPSCQueue(const MPSCQueue&) = delete;
+    MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+    ~MPSCQueue() {
+        drain([](T&&) {});
+    }
+
+    // Safe from any thread. Returns true if the queue was empty, so the
+    // producer knows it is the one that needs to wake the consumer.
+    bool push(T value) {
+        Node* node = new Node{std::move(value), head.load(std::memory_order_relaxed)};
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+        return node->next == nullptr;
+    }
+
+    // Consumer thread only. Hands every queued item to func, oldest first.
+    template <typename F>
+    void drain(F func) {
+        Node* node = head.exchange(nullptr, std::memory_order_acquire);
+        Node* ordered = nullptr;
+        while (node) {
+            Node* next = node->next;
+            node->next = ordered;
+            ordered = node;
+            node = next;
+        }
+        while (ordered) {
+            Node* next = ordered->next;
+            func(std::move(ordered->value));
+            delete ordered;
+            ordered = next;
+        }
+    }
+
+private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+    std::atomic<Node*> head;
+};
+
+#endif
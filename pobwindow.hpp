@@ -6,8 +6,15 @@
 #include <QTimer>
 #include <memory>
 
+#include "drawlist.hpp"
+#include "gcscheduler.hpp"
+#include "inputlog.hpp"
 #include "main.h"
+#include "modulecache.hpp"
+#include "startupreport.hpp"
 #include "subscript.hpp"
+#include "textraster.hpp"
+#include "textureupload.hpp"
 
 extern "C" {
     #include "lua.h"
@@ -17,6 +24,16 @@ extern "C" {
 }
 
 
+// Bookkeeping for one ParallelMap() call; chunks are fed to the pool as earlier ones finish
+struct ParallelMap {
+    int callbackRef;
+    std::vector<std::shared_ptr<SubScript>> chunks;
+    size_t nextChunk;
+    int running;
+    std::vector<SubScriptValue> results;
+    QByteArray error;
+};
+
 class POBWindow : public QOpenGLWindow {
     Q_OBJECT
 public:
@@ -37,11 +54,24 @@ public:
         scriptWorkDir = QDir::currentPath();
         basePath = QDir::currentPath();
         userPath = QDir::currentPath();
+        workDirUtf8 = QDir::currentPath().toUtf8();
 
         fontFudge = 0;
+        isDrawing = false;
+        luaReady = false;
+        inputBatching = false;
+        deferText = false;
+        textPending = false;
+        nextParallelMapId = 0;
 
         connect(&updateTimer, &QTimer::timeout, this, QOverload<>::of(&POBWindow::triggerUpdate));
         updateTimer.start(100);
+
+        // Signal us when a subscript completes so we can trigger a repaint.
+        connect(&subScriptPool, &SubScriptPool::jobFinished, this, &POBWindow::subScriptFinished);
+        // Progress is collected as it arrives, so it can't pile up while nothing paints, and
+        // delivered at the start of the next frame
+        connect(&subScriptPool, &SubScriptPool::progressPosted, this, &POBWindow::subScriptProgressPosted);
     }
 
 //    POBWindow() : QOpenGLWindow() {
@@ -54,6 +84,12 @@ public:
     void paintGL();
 
     void subScriptFinished();
+    void collectSubScriptProgress();
+    void subScriptProgressPosted();
+    void subScriptProgress();
+    int claimSubScriptSlot(std::shared_ptr<SubScript> job);
+    void releaseSubScriptSlot(int slot);
+    bool parallelMapChunkFinished(const std::shared_ptr<SubScript>& job);
     void mouseMoveEvent(QMouseEvent *event);
     void mousePressEvent(QMouseEvent *event);
     void mouseReleaseEvent(QMouseEvent *event);
@@ -61,6 +97,13 @@ public:
     void wheelEvent(QWheelEvent *event);
     void keyPressEvent(QKeyEvent *event);
     void keyReleaseEvent(QKeyEvent *event);
+    void dispatchInput(const InputEvent& event);
+    void routeInput(const InputEvent& event);
+    void deliverInput(const InputEvent& event);
+    void flushInput();
+    QPoint cursorPos();
+    int keyboardModifiers();
+    int mouseButtons();
 
     void LAssert(lua_State* L, int cond, const char* fmt, ...);
     int IsUserData(lua_State* L, int index, const char* metaName);
@@ -78,18 +121,38 @@ public:
     QString scriptWorkDir;
     QString basePath;
     QString userPath;
+    QByteArray workDirUtf8;
     int curLayer;
     int curSubLayer;
     int fontFudge;
     int width;
     int height;
     bool isDrawing;
+    bool luaReady;
+    bool inputBatching;
+    // Strings still being rasterized are skipped for the frame rather than waited for
+    bool deferText;
+    bool textPending;
+    std::vector<InputEvent> inputQueue;
+    InputRecorder inputRecorder;
+    InputReplay inputReplay;
     QString fontName;
     float drawColor[4];
     std::map<QPair<int, int>, std::vector<std::unique_ptr<Cmd>>> layers;
+    std::shared_ptr<DrawList> recordingList;
     QList<std::shared_ptr<SubScript>> subScriptList;
+    std::vector<int> freeSubScriptSlots;
+    // Latest undelivered progress per subscript slot
+    std::map<int, SubScriptProgress> pendingProgress;
+    std::map<int, ParallelMap> parallelMaps;
+    int nextParallelMapId;
+    SubScriptPool subScriptPool;
+    ModuleCache moduleCache;
+    StartupReport startupReport;
+    GCScheduler gcScheduler;
+    TextureUploader textureUploader;
     std::shared_ptr<QOpenGLTexture> white;
-    QCache<QString, std::shared_ptr<QOpenGLTexture>> stringCache;
+    QCache<QString, std::shared_ptr<TextRaster>> stringCache;
     QTimer updateTimer;
     void triggerUpdate();
 };
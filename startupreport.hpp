@@ -0,0 +1,70 @@
+#ifndef STARTUPREPORT_HPP
+#define STARTUPREPORT_HPP
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QString>
+
+#include <vector>
+
+#include "logger.hpp"
+
+// Wall-clock start and end of each startup phase, printed once the first frame is up (--startup-report).
+// Phases may begin and end on any thread.
+class StartupReport {
+public:
+    StartupReport() : enabled(false), printed(false) {
+        timer.start();
+    }
+
+    void begin(const QString& name) {
+        QMutexLocker lock(&mutex);
+        phases.push_back({name, timer.elapsed(), -1, QString()});
+    }
+
+    void end(const QString& name, const QString& detail = QString()) {
+        QMutexLocker lock(&mutex);
+        for (auto& phase : phases) {
+            if (phase.name == name && phase.end < 0) {
+                phase.end = timer.elapsed();
+                phase.detail = detail;
+                break;
+            }
+        }
+    }
+
+    void print() {
+        QMutexLocker lock(&mutex);
+        if (!enabled || printed) {
+            return;
+        }
+        printed = true;
+        qint64 now = timer.elapsed();
+        LogPrintf("Startup report (ms since launch):");
+        for (auto& phase : phases) {
+            if (phase.end < 0) {
+                LogPrintf("  %-12s %6lld ->  still running", phase.name.toStdString().c_str(), phase.start);
+            } else {
+                LogPrintf("  %-12s %6lld -> %6lld  %6lld  %s", phase.name.toStdString().c_str(), phase.start, phase.end,
+                        phase.end - phase.start, phase.detail.toStdString().c_str());
+            }
+        }
+        LogPrintf("  first frame  %6lld", now);
+    }
+
+    bool enabled;
+
+private:
+    struct Phase {
+        QString name;
+        qint64 start;
+        qint64 end;
+        QString detail;
+    };
+    QMutex mutex;
+    QElapsedTimer timer;
+    std::vector<Phase> phases;
+    bool printed;
+};
+
+#endif
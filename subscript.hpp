@@ -1,9 +1,28 @@
 #ifndef SUBSCRIPT_HPP
 #define SUBSCRIPT_HPP
 
+#include <QByteArray>
+#include <QMutex>
+#include <QObject>
+#include <QStringList>
 #include <QThread>
+#include <QWaitCondition>
 
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "blob.hpp"
+#include "buildcode.hpp"
+#include "compress.hpp"
+#include "bytecode.hpp"
+#include "datapack.hpp"
+#include "logger.hpp"
+#include "luaalloc.hpp"
+#include "mpscqueue.hpp"
+#include "xmlparser.hpp"
 
 extern "C" {
     #include "lua.h"
@@ -12,88 +31,485 @@ extern "C" {
     #include "luajit.h"
 }
 
-static int dummy_ConPrintf(lua_State* L)
+// ConPrintf() for sub scripts; string.format is upvalue 1. Lines are tagged so they can be
+// told apart from the main state's in the log.
+static int l_SubConPrintf(lua_State* L)
 {
+    int n = lua_gettop(L);
+    if (n < 1 || !lua_isstring(L, 1)) {
+        return luaL_error(L, "Usage: ConPrintf(fmt[, ...])");
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, n, 1);
+    size_t len;
+    const char* str = lua_tolstring(L, 1, &len);
+    if (!str) {
+        return luaL_error(L, "ConPrintf() error: string.format returned non-string");
+    }
+    static const char tag[] = "[sub] ";
+    Logger::instance().write(sizeof(tag) - 1 + len, [str](char* dest, size_t destLen) {
+        memcpy(dest, tag, std::min(destLen, sizeof(tag) - 1));
+        if (destLen > sizeof(tag) - 1) {
+            memcpy(dest + sizeof(tag) - 1, str, destLen - (sizeof(tag) - 1));
+        }
+    });
     return 0;
 }
 
-class SubScript : public QThread {
-    Q_OBJECT
+// A nil, boolean, number, string or blob passed between the main state and a sub script.
+// Strings are copied once into the QByteArray; blobs just share its storage.
+struct SubScriptValue {
+    int type;
+    bool boolean;
+    lua_Number number;
+    QByteArray string;
+    int offset;
+    int length;
+};
+
+static bool ReadSubScriptValue(lua_State* L, int index, SubScriptValue& value)
+{
+    value.type = lua_type(L, index);
+    switch (value.type) {
+    case LUA_TNIL:
+        break;
+    case LUA_TBOOLEAN:
+        value.boolean = lua_toboolean(L, index);
+        break;
+    case LUA_TNUMBER:
+        value.number = lua_tonumber(L, index);
+        break;
+    case LUA_TSTRING:
+    {
+        size_t len;
+        const char* str = lua_tolstring(L, index, &len);
+        value.string = QByteArray(str, (int)len);
+        value.offset = 0;
+        value.length = value.string.size();
+    }
+    break;
+    case LUA_TUSERDATA:
+        if (blob_s* blob = ToBlob(L, index)) {
+            value.string = blob->data;
+            value.offset = blob->offset;
+            value.length = blob->length;
+            break;
+        }
+        return false;
+    default:
+        return false;
+    }
+    return true;
+}
+
+static void PushSubScriptValue(lua_State* L, const SubScriptValue& value)
+{
+    switch (value.type) {
+    case LUA_TBOOLEAN:
+        lua_pushboolean(L, value.boolean);
+        break;
+    case LUA_TNUMBER:
+        lua_pushnumber(L, value.number);
+        break;
+    case LUA_TSTRING:
+        lua_pushlstring(L, value.string.constData() + value.offset, value.length);
+        break;
+    case LUA_TUSERDATA:
+        PushBlob(L, value.string, value.offset, value.length);
+        break;
+    default:
+        lua_pushnil(L);
+        break;
+    }
+}
+
+// One LaunchSubScript() job; runs on whichever pool worker picks it up
+class SubScript {
 public:
-    SubScript(lua_State *L_main) {
-        L = luaL_newstate();
+    SubScript(lua_State *L_main, int Id) : id(Id), mapId(-1), firstIndex(0), finished(false), aborted(false), badResult(-1) {
+        size_t len;
+        const char* text = lua_tolstring(L_main, 1, &len);
+        script = QByteArray(text, (int)len);
+        for (int stackpos = 4;stackpos <= lua_gettop(L_main);stackpos++) {
+            args.emplace_back();
+            ReadSubScriptValue(L_main, stackpos, args.back());
+        }
+    }
+
+    // One chunk of a ParallelMap(); the script is called once for each of args
+    SubScript(const QByteArray& Script, std::vector<SubScriptValue> Inputs, int MapId, int FirstIndex)
+        : id(-1), mapId(MapId), firstIndex(FirstIndex), script(Script), args(std::move(Inputs)), finished(false), aborted(false), badResult(-1) {
+    }
+
+    bool isFinished() const {
+        return finished.load();
+    }
+
+    void onSubFinished(lua_State *L_main) {
+        if (badResult >= 0) {
+            LogPrintf("Subscript return %d: only nil, boolean, number, string and blob can be returned from sub script", badResult);
+            return;
+        }
+        callMainObject(L_main, "OnSubFinished", results);
+    }
+
+    void onSubProgress(lua_State *L_main, const std::vector<SubScriptValue>& values) {
+        callMainObject(L_main, "OnSubProgress", values);
+    }
+
+    int id;
+    int mapId;
+    int firstIndex;
+    QByteArray script;
+    std::vector<SubScriptValue> args;
+    std::vector<SubScriptValue> results;
+    std::atomic<bool> finished;
+    std::atomic<bool> aborted;
+    int badResult;
+    QByteArray error;
+
+private:
+    void callMainObject(lua_State *L_main, const char* name, const std::vector<SubScriptValue>& values) {
+        lua_getfield(L_main, LUA_REGISTRYINDEX, "uicallbacks");
+        lua_getfield(L_main, -1, "MainObject");
+        lua_remove(L_main, -2);
+        lua_getfield(L_main, -1, name);
+        if (!lua_isfunction(L_main, -1)) {
+            lua_pop(L_main, 2);
+            return;
+        }
+        lua_insert(L_main, -2);
+        lua_pushinteger(L_main, id);
+        for (auto& value : values) {
+            PushSubScriptValue(L_main, value);
+        }
+        int result = lua_pcall(L_main, values.size() + 2, 0, 0);
+        if (result) {
+            LogPrintf("Error calling %s: %d\n%s", name, result, lua_tostring(L_main, -1));
+            lua_pop(L_main, 1);
+        }
+    }
+};
+
+// Intermediate results posted by a running sub script with PostSubProgress()
+struct SubScriptProgress {
+    std::shared_ptr<SubScript> job;
+    std::vector<SubScriptValue> values;
+};
+
+class SubScriptPool;
+
+// Pool thread owning a lua_State that outlives the jobs it runs
+class SubScriptWorker : public QThread {
+public:
+    SubScriptWorker(SubScriptPool* Pool) : pool(Pool), L(nullptr), pristineRef(LUA_NOREF), preloadGeneration(0) {}
+
+    void run() override;
+
+    // Called from the GUI thread. The abort hook is only armed once the job it
+    // belongs to is aborted, since any active hook keeps LuaJIT from compiling
+    // traces; lua_sethook() is safe to call on a state another thread is running.
+    // Compiled code never polls hooks, so the job unwinds at its next interpreted
+    // instruction, and a loop that stays inside one trace runs until it exits
+    void interrupt(const std::shared_ptr<SubScript>& job) {
+        QMutexLocker lock(&currentMutex);
+        if (current == job) {
+            lua_sethook(L, abortHook, LUA_MASKCOUNT, 1);
+        }
+    }
+private:
+    void initState() {
+        L = allocator.newState();
         // FIXME check for failure?
         lua_pushlightuserdata(L, this);
         lua_rawseti(L, LUA_REGISTRYINDEX, 0);
         luaL_openlibs(L);
-        lua_pushcfunction(L, dummy_ConPrintf);
+        lua_getglobal(L, "string");
+        lua_getfield(L, -1, "format");
+        lua_pushcclosure(L, l_SubConPrintf, 1);
         lua_setglobal(L, "ConPrintf");
-        int err = luaL_loadstring(L, lua_tostring(L_main, 1));
-        if (err) {
-            std::cout << "Error in subscript: " << err << std::endl;
-            std::cout << lua_tostring(L, -1) << std::endl;
+        lua_pop(L, 1);
+        lua_pushcfunction(L, l_PostSubProgress);
+        lua_setglobal(L, "PostSubProgress");
+        RegisterBlob(L);
+        RegisterCompress(L);
+        RegisterBuildCode(L);
+        RegisterXML(L);
+        RegisterDataPack(L);
+        RegisterAllocStats(L, &allocator);
+        lua_pushvalue(L, LUA_GLOBALSINDEX);
+        pristineRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+
+    void preload(const QStringList& modules) {
+        for (auto& module : modules) {
+            lua_getglobal(L, "require");
+            lua_pushstring(L, module.toStdString().c_str());
+            if (lua_pcall(L, 1, 0, 0)) {
+                LogPrintf("Error preloading %s in subscript: %s", module.toUtf8().constData(), lua_tostring(L, -1));
+                lua_pop(L, 1);
+            }
         }
-        for (int stackpos = 4;stackpos <= lua_gettop(L_main);stackpos++) {
-            switch (lua_type(L_main, stackpos)) {
-            case LUA_TNIL:
-                lua_pushnil(L);
-                break;
-            case LUA_TBOOLEAN:
-                lua_pushboolean(L, lua_toboolean(L_main, stackpos));
-                break;
-            case LUA_TNUMBER:
-                lua_pushnumber(L, lua_tonumber(L_main, stackpos));
+    }
+
+    // Raising an error from here unwinds the job back to our lua_pcall like
+    // any other runtime error
+    static void abortHook(lua_State* L, lua_Debug* ar) {
+        SubScriptWorker* worker = fromState(L);
+        if (worker->current && worker->current->aborted) {
+            luaL_error(L, "subscript aborted");
+        }
+    }
+
+    static SubScriptWorker* fromState(lua_State* L) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, 0);
+        auto worker = (SubScriptWorker*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return worker;
+    }
+
+    static int l_PostSubProgress(lua_State* L);
+
+    ScriptCache& scriptCache();
+
+    // Calls the loaded chunk as script(input, index) for each input, keeping the first result of each
+    void runMap(SubScript& job) {
+        job.results.resize(job.args.size());
+        for (size_t i = 0; i < job.args.size(); i++) {
+            lua_pushvalue(L, 1);
+            PushSubScriptValue(L, job.args[i]);
+            lua_pushinteger(L, job.firstIndex + i);
+            if (lua_pcall(L, 2, 1, 0)) {
+                job.error = lua_tostring(L, -1);
                 break;
-            case LUA_TSTRING:
-                lua_pushstring(L, lua_tostring(L_main, stackpos));
+            }
+            if (!ReadSubScriptValue(L, -1, job.results[i])) {
+                job.badResult = job.firstIndex + i;
                 break;
             }
+            lua_pop(L, 1);
         }
-        lua_pushnumber(L, lua_gettop(L_main) - 3);
+        lua_settop(L, 0);
     }
-    
-    void run() override {
-        int numarg = (int)lua_tointeger(L, -1);
-        lua_pop(L, 1);
-        if (lua_pcall(L, numarg, LUA_MULTRET, 0)) {
-            std::cout << "Error in thread call: " << lua_tostring(L, -1) << std::endl;
+
+    void runJob(const std::shared_ptr<SubScript>& jobPtr) {
+        SubScript& job = *jobPtr;
+        {
+            QMutexLocker lock(&currentMutex);
+            current = jobPtr;
+        }
+        // Checked after publishing current, so an abort either lands here or
+        // finds the job in interrupt() and arms the hook
+        if (job.aborted) {
+            QMutexLocker lock(&currentMutex);
+            current.reset();
+            return;
         }
-    };
 
-    void onSubFinished(lua_State *L_main, int id) {
-        lua_getfield(L_main, LUA_REGISTRYINDEX, "uicallbacks");
-        lua_getfield(L_main, -1, "MainObject");
-        lua_remove(L_main, -2);
-        lua_getfield(L_main, -1, "OnSubFinished");
-        lua_insert(L_main, -2);
-        lua_pushinteger(L_main, id);
-        int n = lua_gettop(L);
-        for (int i = 1; i <= n; i++) {
-            switch (lua_type(L, i)) {
-            case LUA_TNIL:
-                lua_pushnil(L_main);
-                break;
-            case LUA_TBOOLEAN:
-                lua_pushboolean(L_main, lua_toboolean(L, i));
-                break;
-            case LUA_TNUMBER:
-                lua_pushnumber(L_main, lua_tonumber(L, i));
-                break;
-            case LUA_TSTRING:
-                lua_pushstring(L_main, lua_tostring(L, i));
-                break;
-            default:
-                std::cout << "Subscript return " << (i - 1) << ": only nil, boolean, number and string can be returned from sub script" << std::endl;
-                return;
+        // Each job gets an empty globals table that falls back to the pristine
+        // one, so dropping it afterwards undoes the globals it assigned. Only
+        // those are undone: changes made through them to tables the pristine
+        // globals hold (string, table, other library tables, package.loaded
+        // and the modules in it) persist into later jobs on this worker
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -2, "_G");
+        lua_newtable(L);
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pristineRef);
+        lua_setfield(L, -2, "__index");
+        lua_setmetatable(L, -2);
+        lua_replace(L, LUA_GLOBALSINDEX);
+
+        int err = scriptCache().load(L, job.script);
+        if (err) {
+            LogPrintf("Error in subscript: %d\n%s", err, lua_tostring(L, -1));
+        } else if (job.mapId >= 0) {
+            runMap(job);
+        } else {
+            for (auto& arg : job.args) {
+                PushSubScriptValue(L, arg);
+            }
+            if (lua_pcall(L, job.args.size(), LUA_MULTRET, 0) && !job.aborted) {
+                LogPrintf("Error in thread call: %s", lua_tostring(L, -1));
             }
         }
-        int result = lua_pcall(L_main, lua_gettop(L) + 2, 0, 0);
-        if (result) {
-            std::cout << "Error calling OnSubFinished: " << result << std::endl;
-            std::cout << lua_tostring(L_main, -1) << std::endl;
+        if (job.mapId >= 0) {
+            if (err) {
+                job.error = lua_tostring(L, -1);
+            }
+        } else {
+            int n = lua_gettop(L);
+            job.results.resize(n);
+            for (int i = 1; i <= n; i++) {
+                if (!ReadSubScriptValue(L, i, job.results[i - 1])) {
+                    job.badResult = i - 1;
+                    break;
+                }
+            }
         }
+        lua_settop(L, 0);
+
+        {
+            QMutexLocker lock(&currentMutex);
+            lua_sethook(L, nullptr, 0, 0);
+            current.reset();
+        }
+        lua_rawgeti(L, LUA_REGISTRYINDEX, pristineRef);
+        lua_replace(L, LUA_GLOBALSINDEX);
     }
+
+    SubScriptPool* pool;
+    LuaAllocator allocator;
     lua_State *L;
+    int pristineRef;
+    int preloadGeneration;
+    std::shared_ptr<SubScript> current;
+    QMutex currentMutex;
+};
+
+// Fixed set of workers, one per core, fed from a shared job queue
+class SubScriptPool : public QObject {
+    Q_OBJECT
+public:
+    SubScriptPool() : stopping(false), preloadGeneration(0) {}
+
+    ~SubScriptPool() {
+        {
+            QMutexLocker lock(&mutex);
+            stopping = true;
+            wake.wakeAll();
+        }
+        for (auto& worker : workers) {
+            worker->wait();
+        }
+    }
+
+    void submit(std::shared_ptr<SubScript> job) {
+        QMutexLocker lock(&mutex);
+        if (workers.empty()) {
+            int count = std::max(1, QThread::idealThreadCount());
+            for (int i = 0; i < count; i++) {
+                workers.emplace_back(new SubScriptWorker(this));
+                workers.back()->start();
+            }
+        }
+        queue.push_back(std::move(job));
+        wake.wakeOne();
+    }
+
+    // Drops the job if it hasn't started yet, otherwise arms the hook that unwinds it
+    void abort(const std::shared_ptr<SubScript>& job) {
+        QMutexLocker lock(&mutex);
+        job->aborted = true;
+        auto it = std::find(queue.begin(), queue.end(), job);
+        if (it != queue.end()) {
+            queue.erase(it);
+            return;
+        }
+        for (auto& worker : workers) {
+            worker->interrupt(job);
+        }
+    }
+
+    // Modules require()d into every worker's pristine globals before its next job
+    void setPreload(const QStringList& modules) {
+        QMutexLocker lock(&mutex);
+        preloadModules = modules;
+        preloadGeneration++;
+    }
+
+    // Blocks until a job is available; returns null once the pool is shutting down
+    std::shared_ptr<SubScript> take(int& generation, QStringList& modules) {
+        QMutexLocker lock(&mutex);
+        while (queue.empty() && !stopping) {
+            wake.wait(&mutex);
+        }
+        if (stopping) {
+            return nullptr;
+        }
+        auto job = std::move(queue.front());
+        queue.pop_front();
+        if (generation != preloadGeneration) {
+            generation = preloadGeneration;
+            modules = preloadModules;
+        }
+        return job;
+    }
+
+    // Called from worker threads; the signals are only raised for the first
+    // item in an empty queue, the GUI thread then drains everything at once
+    void postFinished(std::shared_ptr<SubScript> job) {
+        if (completed.push(std::move(job))) {
+            emit jobFinished();
+        }
+    }
+
+    void postProgress(SubScriptProgress item) {
+        if (progress.push(std::move(item))) {
+            emit progressPosted();
+        }
+    }
+
+    MPSCQueue<std::shared_ptr<SubScript>> completed;
+    MPSCQueue<SubScriptProgress> progress;
+    ScriptCache cache;
+
+signals:
+    void jobFinished();
+    void progressPosted();
+
+private:
+    QMutex mutex;
+    QWaitCondition wake;
+    std::deque<std::shared_ptr<SubScript>> queue;
+    std::vector<std::unique_ptr<SubScriptWorker>> workers;
+    bool stopping;
+    QStringList preloadModules;
+    int preloadGeneration;
 };
 
+inline void SubScriptWorker::run() {
+    initState();
+    while (true) {
+        int generation = preloadGeneration;
+        QStringList modules;
+        auto job = pool->take(generation, modules);
+        if (!job) {
+            break;
+        }
+        if (generation != preloadGeneration) {
+            preloadGeneration = generation;
+            preload(modules);
+        }
+        runJob(job);
+        job->finished = true;
+        pool->postFinished(std::move(job));
+    }
+    lua_close(L);
+    L = nullptr;
+}
+
+inline ScriptCache& SubScriptWorker::scriptCache() {
+    return pool->cache;
+}
+
+inline int SubScriptWorker::l_PostSubProgress(lua_State* L)
+{
+    SubScriptWorker* worker = fromState(L);
+    if (!worker->current) {
+        return luaL_error(L, "PostSubProgress() called outside of a sub script");
+    }
+    SubScriptProgress item{worker->current, {}};
+    int n = lua_gettop(L);
+    item.values.resize(n);
+    for (int i = 1; i <= n; i++) {
+        if (!ReadSubScriptValue(L, i, item.values[i - 1])) {
+            return luaL_error(L, "PostSubProgress() argument %d: only nil, boolean, number, string and blob can be posted", i);
+        }
+    }
+    worker->pool->postProgress(std::move(item));
+    return 0;
+}
+
 #endif
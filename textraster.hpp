@@ -0,0 +1,179 @@
+#ifndef TEXTRASTER_HPP
+#define TEXTRASTER_HPP
+
+#include <QColor>
+#include <QFont>
+#include <QFontDatabase>
+#include <QImage>
+#include <QMutex>
+#include <QPainter>
+#include <QRunnable>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "textureupload.hpp"
+
+// RGBA images that text is rasterized into, handed back once the pixels are uploaded so a
+// burst of new strings doesn't allocate an image apiece. Sizes are rounded up so one buffer
+// fits many strings; each string is drawn into the top-left corner and uploaded from there.
+class TextScratchPool {
+public:
+    static const int MAX_FREE = 32;
+    static const qint64 MAX_POOLED_BYTES = 4 << 20;
+
+    QImage take(int width, int height) {
+        {
+            QMutexLocker lock(&mutex);
+            int best = -1;
+            for (int i = 0; i < (int)free.size(); i++) {
+                const QImage& image = free[i];
+                if (image.width() >= width && image.height() >= height
+                        && (best < 0 || image.sizeInBytes() < free[best].sizeInBytes())) {
+                    best = i;
+                }
+            }
+            if (best >= 0) {
+                QImage image = free[best];
+                free.erase(free.begin() + best);
+                return image;
+            }
+        }
+        return QImage((width + 255) & ~255, (height + 31) & ~31, QImage::Format_RGBA8888);
+    }
+
+    void give(const QImage& image) {
+        if (image.sizeInBytes() > MAX_POOLED_BYTES) {
+            return;
+        }
+        QMutexLocker lock(&mutex);
+        if ((int)free.size() < MAX_FREE) {
+            free.push_back(image);
+        }
+    }
+
+private:
+    QMutex mutex;
+    std::vector<QImage> free;
+};
+
+// A string being rasterized for DrawString(). Its size comes from the font metrics up front,
+// so layout never has to wait; the pixels are drawn on a worker thread while Lua carries on
+// with the frame, and become a texture the first time the string is drawn after that.
+class TextRaster {
+public:
+    TextRaster(int Width, int Height) : width(Width), height(Height), ready(false) {}
+
+    // Starts drawing text in white at the given size. Falls back to drawing it right here
+    // where the platform can't render fonts off the GUI thread.
+    static std::shared_ptr<TextRaster> start(const QString& fontName, int pixelSize, const QString& text, QSize size) {
+        auto raster = std::make_shared<TextRaster>(size.width(), size.height());
+        if (raster->isEmpty()) {
+            raster->ready = true;
+            return raster;
+        }
+        Task* task = new Task(raster, fontName, pixelSize, text);
+        if (QFontDatabase::supportsThreadedFontRendering()) {
+            threads().start(task);
+        } else {
+            task->run();
+            delete task;
+        }
+        return raster;
+    }
+
+    bool isEmpty() const {
+        return width <= 0 || height <= 0;
+    }
+
+    // GUI thread only, with the GL context current. Returns null while the pixels are still being
+    // drawn, unless wait is set, in which case it blocks for them. Empty strings never get a texture.
+    std::shared_ptr<QOpenGLTexture> texture(bool wait, TextureUploader& uploader, const std::shared_ptr<QOpenGLTexture>& white) {
+        if (tex || isEmpty()) {
+            return tex;
+        }
+        QImage image;
+        {
+            QMutexLocker lock(&mutex);
+            if (!ready && !wait) {
+                return nullptr;
+            }
+            while (!ready) {
+                done.wait(&mutex);
+            }
+            image = scratch;
+            scratch = QImage();
+        }
+        // A view of the used corner; the upload copies it before the buffer goes back to the pool
+        QImage view(image.constBits(), width, height, image.bytesPerLine(), QImage::Format_RGBA8888);
+        auto upload = std::make_shared<TextureUpload>(view);
+        uploader.uploadNow(upload, white);
+        tex = upload->texture;
+        scratchPool().give(image);
+        return tex;
+    }
+
+    const int width;
+    const int height;
+
+private:
+    class Task : public QRunnable {
+    public:
+        Task(std::shared_ptr<TextRaster> Raster, const QString& FontName, int PixelSize, const QString& Text)
+            : raster(Raster), fontName(FontName), pixelSize(PixelSize), text(Text) {}
+
+        void run() override {
+            int w = raster->width;
+            int h = raster->height;
+            QImage image = scratchPool().take(w, h);
+            // Transparent white, so filtering at the glyph edges doesn't blend towards black
+            static const uchar clear[4] = {255, 255, 255, 0};
+            for (int y = 0; y < h; y++) {
+                uchar* row = image.scanLine(y);
+                for (int x = 0; x < w; x++) {
+                    memcpy(row + x * 4, clear, 4);
+                }
+            }
+            QFont font(fontName);
+            font.setPixelSize(pixelSize);
+            QPainter p(&image);
+            p.setPen(QColor(255, 255, 255, 255));
+            p.setFont(font);
+            p.setCompositionMode(QPainter::CompositionMode_Plus);
+            p.drawText(0, 0, w, h, 0, text);
+            p.end();
+            QMutexLocker lock(&raster->mutex);
+            raster->scratch = image;
+            raster->ready = true;
+            raster->done.wakeAll();
+        }
+    private:
+        std::shared_ptr<TextRaster> raster;
+        QString fontName;
+        int pixelSize;
+        QString text;
+    };
+
+    // Kept apart from the global pool so text isn't stuck behind image decodes
+    static QThreadPool& threads() {
+        static QThreadPool pool;
+        return pool;
+    }
+
+    static TextScratchPool& scratchPool() {
+        static TextScratchPool pool;
+        return pool;
+    }
+
+    QMutex mutex;
+    QWaitCondition done;
+    bool ready;
+    QImage scratch;
+    std::shared_ptr<QOpenGLTexture> tex;
+};
+
+#endif
@@ -0,0 +1,278 @@
+#ifndef TEXTUREUPLOAD_HPP
+#define TEXTUREUPLOAD_HPP
+
+#include <QElapsedTimer>
+#include <QImage>
+#include <QOpenGLBuffer>
+#include <QOpenGLTexture>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <memory>
+
+extern "C" {
+    #include "lua.h"
+}
+
+// An image on its way into a texture. The decode thread has already converted the pixels to
+// RGBA8888, so each row goes to GL as it is.
+class TextureUpload {
+public:
+    explicit TextureUpload(const QImage& Image) : rowsDone(0), queued(false), finished(false) {
+        image = Image.format() == QImage::Format_RGBA8888 ? Image : Image.convertToFormat(QImage::Format_RGBA8888);
+    }
+
+    bool isDone() const {
+        return finished;
+    }
+
+    qint64 remainingBytes() const {
+        return finished ? 0 : (qint64)(image.height() - rowsDone) * image.bytesPerLine();
+    }
+
+    // Set once every row is in
+    std::shared_ptr<QOpenGLTexture> texture;
+
+private:
+    friend class TextureUploader;
+
+    QImage image;
+    std::shared_ptr<QOpenGLTexture> partial;
+    int rowsDone;
+    bool queued;
+    bool finished;
+};
+
+// Streams queued images into textures a band of rows at a time at the start of each frame,
+// stopping once the frame's byte or time budget is spent, so a screen full of new images is
+// spread over several frames instead of stalling one. Each band is written into the next of a
+// small ring of mapped pixel buffer objects and the texture is updated from there, so the
+// transfer to the GPU runs while the following band is being written; if PBOs aren't available
+// rows are uploaded straight from the image. Every call needs the GL context current. The
+// buffers are left for the context to free on exit.
+class TextureUploader {
+public:
+    static const int PBO_COUNT = 3;
+    static const qint64 DEFAULT_BUDGET_BYTES = 8 << 20;
+    static const qint64 DEFAULT_BUDGET_US = 3000;
+
+    TextureUploader() : budgetBytes(DEFAULT_BUDGET_BYTES), budgetUs(DEFAULT_BUDGET_US), pboState(PBO_UNTRIED), nextPbo(0),
+            queuedBytes(0), maxQueueDepth(0), lastFrameBytes(0), lastFrameUs(0), maxFrameUs(0), busyFrames(0),
+            uploadedBytes(0), uploadedTextures(0), immediateUploads(0), immediateUs(0), abandoned(0) {
+        for (int i = 0; i < PBO_COUNT; i++) {
+            pbos[i] = QOpenGLBuffer(QOpenGLBuffer::PixelUnpackBuffer);
+        }
+    }
+
+    // Either limit may be 0 to leave it out; at least one band is uploaded each frame regardless
+    void setBudget(qint64 bytes, qint64 us) {
+        budgetBytes = bytes > 0 ? bytes : LLONG_MAX;
+        budgetUs = us > 0 ? us : LLONG_MAX;
+    }
+
+    void enqueue(const std::shared_ptr<TextureUpload>& upload) {
+        if (upload->queued || upload->finished) {
+            return;
+        }
+        upload->queued = true;
+        queue.push_back(upload);
+        queuedBytes += upload->remainingBytes();
+        maxQueueDepth = std::max(maxQueueDepth, (int)queue.size());
+    }
+
+    // Uploads the whole image right away, outside the budget, for images drawn without ASYNC
+    void uploadNow(const std::shared_ptr<TextureUpload>& upload, const std::shared_ptr<QOpenGLTexture>& white) {
+        if (upload->finished) {
+            return;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        if (upload->queued) {
+            queuedBytes -= upload->remainingBytes();
+        }
+        while (!upload->finished) {
+            uploadedBytes += uploadRows(*upload, upload->image.height() - upload->rowsDone, white);
+        }
+        immediateUploads++;
+        immediateUs += timer.nsecsElapsed() / 1000;
+    }
+
+    // Called at the start of each frame; returns true while there's still work queued
+    bool process(const std::shared_ptr<QOpenGLTexture>& white) {
+        if (queue.empty()) {
+            return false;
+        }
+        QElapsedTimer timer;
+        timer.start();
+        qint64 bytes = 0;
+        while (!queue.empty() && bytes < budgetBytes && timer.nsecsElapsed() / 1000 < budgetUs) {
+            std::shared_ptr<TextureUpload>& upload = queue.front();
+            if (upload->finished || upload.use_count() == 1) {
+                // Uploaded by uploadNow(), or the image handle was unloaded or collected meanwhile
+                if (!upload->finished) {
+                    queuedBytes -= upload->remainingBytes();
+                    abandoned++;
+                }
+                queue.pop_front();
+                continue;
+            }
+            int bytesPerLine = std::max(upload->image.bytesPerLine(), 1);
+            qint64 rows = std::max<qint64>((budgetBytes - bytes) / bytesPerLine, 1);
+            rows = std::min<qint64>(rows, upload->image.height() - upload->rowsDone);
+            bytes += uploadRows(*upload, (int)rows, white);
+            if (upload->finished) {
+                queue.pop_front();
+            }
+        }
+        queuedBytes -= bytes;
+        uploadedBytes += bytes;
+        lastFrameBytes = bytes;
+        lastFrameUs = timer.nsecsElapsed() / 1000;
+        maxFrameUs = std::max(maxFrameUs, lastFrameUs);
+        busyFrames++;
+        return !queue.empty();
+    }
+
+    int queueDepth() const {
+        return (int)queue.size();
+    }
+
+    // Pushes { queued, queuedBytes, maxQueued, budgetBytes, budgetMs, lastFrameBytes, lastFrameMs,
+    // maxFrameMs, busyFrames, uploadedBytes, textures, immediate, immediateMs, abandoned, pbo }
+    void push(lua_State* L) const {
+        lua_createtable(L, 0, 15);
+        lua_pushinteger(L, (lua_Integer)queue.size());
+        lua_setfield(L, -2, "queued");
+        lua_pushnumber(L, (lua_Number)queuedBytes);
+        lua_setfield(L, -2, "queuedBytes");
+        lua_pushinteger(L, maxQueueDepth);
+        lua_setfield(L, -2, "maxQueued");
+        lua_pushnumber(L, budgetBytes == LLONG_MAX ? 0 : (lua_Number)budgetBytes);
+        lua_setfield(L, -2, "budgetBytes");
+        lua_pushnumber(L, budgetUs == LLONG_MAX ? 0 : budgetUs / 1000.0);
+        lua_setfield(L, -2, "budgetMs");
+        lua_pushnumber(L, (lua_Number)lastFrameBytes);
+        lua_setfield(L, -2, "lastFrameBytes");
+        lua_pushnumber(L, lastFrameUs / 1000.0);
+        lua_setfield(L, -2, "lastFrameMs");
+        lua_pushnumber(L, maxFrameUs / 1000.0);
+        lua_setfield(L, -2, "maxFrameMs");
+        lua_pushnumber(L, (lua_Number)busyFrames);
+        lua_setfield(L, -2, "busyFrames");
+        lua_pushnumber(L, (lua_Number)uploadedBytes);
+        lua_setfield(L, -2, "uploadedBytes");
+        lua_pushnumber(L, (lua_Number)uploadedTextures);
+        lua_setfield(L, -2, "textures");
+        lua_pushnumber(L, (lua_Number)immediateUploads);
+        lua_setfield(L, -2, "immediate");
+        lua_pushnumber(L, immediateUs / 1000.0);
+        lua_setfield(L, -2, "immediateMs");
+        lua_pushnumber(L, (lua_Number)abandoned);
+        lua_setfield(L, -2, "abandoned");
+        lua_pushboolean(L, pboState == PBO_READY);
+        lua_setfield(L, -2, "pbo");
+    }
+
+private:
+    enum PboState { PBO_UNTRIED, PBO_READY, PBO_UNAVAILABLE };
+
+    // Uploads the next rows of the image, creating the texture first if need be; returns the bytes sent
+    qint64 uploadRows(TextureUpload& upload, int rows, const std::shared_ptr<QOpenGLTexture>& white) {
+        const QImage& image = upload.image;
+        if (!upload.partial) {
+            if (image.isNull()) {
+                finish(upload, white);
+                return 0;
+            }
+            upload.partial = std::make_shared<QOpenGLTexture>(QOpenGLTexture::Target2D);
+            upload.partial->setFormat(QOpenGLTexture::RGBA8_UNorm);
+            upload.partial->setSize(image.width(), image.height());
+            upload.partial->setMipLevels(upload.partial->maximumMipLevels());
+            upload.partial->allocateStorage(QOpenGLTexture::RGBA, QOpenGLTexture::UInt8);
+            if (!upload.partial->isCreated()) {
+                finish(upload, white);
+                return 0;
+            }
+        }
+        const uchar* src = image.constScanLine(upload.rowsDone);
+        int bytes = rows * image.bytesPerLine();
+        upload.partial->bind();
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        // Images can be views into a wider buffer
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, image.bytesPerLine() / 4);
+        if (QOpenGLBuffer* pbo = nextBuffer()) {
+            pbo->bind();
+            // Orphan the buffer and write the band straight into the mapping; the old contents are
+            // invalidated, so this never waits for GL to finish reading a band sent earlier
+            pbo->allocate(bytes);
+            if (void* dest = pbo->mapRange(0, bytes, QOpenGLBuffer::RangeWrite | QOpenGLBuffer::RangeInvalidateBuffer)) {
+                memcpy(dest, src, bytes);
+                pbo->unmap();
+            } else {
+                pbo->allocate(src, bytes);
+            }
+            // Sourced from the buffer, so this returns without waiting for the transfer
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, upload.rowsDone, image.width(), rows, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+            pbo->release();
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, upload.rowsDone, image.width(), rows, GL_RGBA, GL_UNSIGNED_BYTE, src);
+        }
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        upload.rowsDone += rows;
+        if (upload.rowsDone >= image.height()) {
+            upload.partial->generateMipMaps();
+            finish(upload, upload.partial);
+        }
+        return bytes;
+    }
+
+    void finish(TextureUpload& upload, const std::shared_ptr<QOpenGLTexture>& texture) {
+        upload.texture = texture;
+        upload.partial.reset();
+        upload.image = QImage();
+        upload.finished = true;
+        uploadedTextures++;
+    }
+
+    QOpenGLBuffer* nextBuffer() {
+        if (pboState == PBO_UNTRIED) {
+            pboState = PBO_READY;
+            for (int i = 0; i < PBO_COUNT; i++) {
+                if (!pbos[i].create()) {
+                    pboState = PBO_UNAVAILABLE;
+                    break;
+                }
+                pbos[i].setUsagePattern(QOpenGLBuffer::StreamDraw);
+            }
+        }
+        if (pboState != PBO_READY) {
+            return nullptr;
+        }
+        QOpenGLBuffer* pbo = &pbos[nextPbo];
+        nextPbo = (nextPbo + 1) % PBO_COUNT;
+        return pbo;
+    }
+
+    qint64 budgetBytes;
+    qint64 budgetUs;
+    std::deque<std::shared_ptr<TextureUpload>> queue;
+    QOpenGLBuffer pbos[PBO_COUNT];
+    PboState pboState;
+    int nextPbo;
+
+    qint64 queuedBytes;
+    int maxQueueDepth;
+    qint64 lastFrameBytes;
+    qint64 lastFrameUs;
+    qint64 maxFrameUs;
+    quint64 busyFrames;
+    qint64 uploadedBytes;
+    quint64 uploadedTextures;
+    quint64 immediateUploads;
+    qint64 immediateUs;
+    quint64 abandoned;
+};
+
+#endif
@@ -0,0 +1,476 @@
+#ifndef XMLPARSER_HPP
+#define XMLPARSER_HPP
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "blob.hpp"
+
+extern "C" {
+    #include "lua.h"
+    #include "lauxlib.h"
+}
+
+// ===========
+// XML parsing
+// ===========
+
+// Non-validating XML parser for build files and tree data. Comments, processing instructions
+// and DOCTYPE are skipped, CDATA is reported as text and whitespace-only text is dropped, as in
+// xml.lua. The sink is told about each element and text run as it is reached:
+//   bool startElement(name, nameLen, attrs, selfClosing)
+//   bool endElement(name, nameLen)
+//   bool text(p, len, escaped)
+// and parsing stops as soon as one of them returns false.
+struct XMLAttr {
+    const char* name;
+    size_t nameLen;
+    const char* value;
+    size_t valueLen;
+};
+
+static void AppendUTF8(std::string& out, unsigned long c)
+{
+    if (c < 0x80) {
+        out += (char)c;
+    } else if (c < 0x800) {
+        out += (char)(0xc0 | (c >> 6));
+        out += (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        out += (char)(0xe0 | (c >> 12));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    } else {
+        out += (char)(0xf0 | (c >> 18));
+        out += (char)(0x80 | ((c >> 12) & 0x3f));
+        out += (char)(0x80 | ((c >> 6) & 0x3f));
+        out += (char)(0x80 | (c & 0x3f));
+    }
+}
+
+// Replaces the predefined and numeric entities; unknown entities are left alone
+static void UnescapeXML(const char* p, size_t len, std::string& out)
+{
+    out.clear();
+    const char* end = p + len;
+    for (const char* c = p; c < end; c++) {
+        if (*c != '&') {
+            out += *c;
+            continue;
+        }
+        const char* semi = (const char*)memchr(c, ';', end - c);
+        if (!semi) {
+            out.append(c, end - c);
+            break;
+        }
+        std::string entity(c + 1, semi - c - 1);
+        if (entity == "lt") {
+            out += '<';
+        } else if (entity == "gt") {
+            out += '>';
+        } else if (entity == "amp") {
+            out += '&';
+        } else if (entity == "quot") {
+            out += '"';
+        } else if (entity == "apos") {
+            out += '\'';
+        } else if (entity.size() > 1 && entity[0] == '#') {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            AppendUTF8(out, strtoul(entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10));
+        } else {
+            out.append(c, semi - c + 1);
+        }
+        c = semi;
+    }
+}
+
+static void PushXMLText(lua_State* L, const char* p, size_t len, std::string& scratch)
+{
+    if (!memchr(p, '&', len)) {
+        lua_pushlstring(L, p, len);
+        return;
+    }
+    UnescapeXML(p, len, scratch);
+    lua_pushlstring(L, scratch.data(), scratch.size());
+}
+
+class XMLParser {
+public:
+    XMLParser(const char* Data, size_t Len) : data(Data), pos(Data), end(Data + Len) {}
+
+    template <typename Sink>
+    bool parse(Sink& sink) {
+        std::vector<std::pair<const char*, size_t>> open;
+        while (pos < end) {
+            if (*pos != '<') {
+                const char* text = pos;
+                pos = find("<", 1);
+                if (!pos) {
+                    pos = end;
+                }
+                if (!isBlank(text, pos - text) && !sink.text(text, pos - text, true)) {
+                    return false;
+                }
+                continue;
+            }
+            if (startsWith("<!--")) {
+                if (!skipPast("-->", 3)) return fail("unterminated comment");
+            } else if (startsWith("<![CDATA[")) {
+                const char* text = pos + 9;
+                if (!skipPast("]]>", 3)) return fail("unterminated CDATA section");
+                if (!sink.text(text, pos - 3 - text, false)) return false;
+            } else if (startsWith("<?")) {
+                if (!skipPast("?>", 2)) return fail("unterminated processing instruction");
+            } else if (startsWith("<!")) {
+                if (!skipDoctype()) return fail("unterminated DOCTYPE");
+            } else if (startsWith("</")) {
+                pos += 2;
+                const char* name = pos;
+                size_t nameLen = readName();
+                skipSpace();
+                if (pos >= end || *pos != '>') return fail("malformed closing tag");
+                pos++;
+                if (open.empty() || open.back().second != nameLen || memcmp(open.back().first, name, nameLen)) {
+                    return fail("mismatched closing tag");
+                }
+                open.pop_back();
+                if (!sink.endElement(name, nameLen)) return false;
+            } else {
+                pos++;
+                const char* name = pos;
+                size_t nameLen = readName();
+                if (nameLen == 0) return fail("expected element name");
+                attrs.clear();
+                bool selfClosing = false;
+                while (true) {
+                    skipSpace();
+                    if (pos >= end) return fail("unterminated start tag");
+                    if (*pos == '>') {
+                        pos++;
+                        break;
+                    }
+                    if (*pos == '/' && pos + 1 < end && pos[1] == '>') {
+                        pos += 2;
+                        selfClosing = true;
+                        break;
+                    }
+                    XMLAttr attr;
+                    attr.name = pos;
+                    attr.nameLen = readName();
+                    if (attr.nameLen == 0) return fail("expected attribute name");
+                    skipSpace();
+                    if (pos >= end || *pos != '=') return fail("expected '=' after attribute name");
+                    pos++;
+                    skipSpace();
+                    if (pos >= end || (*pos != '"' && *pos != '\'')) return fail("expected quoted attribute value");
+                    char quote = *pos++;
+                    attr.value = pos;
+                    pos = find(&quote, 1);
+                    if (!pos) return fail("unterminated attribute value");
+                    attr.valueLen = pos - attr.value;
+                    pos++;
+                    attrs.push_back(attr);
+                }
+                if (!selfClosing) {
+                    open.push_back({name, nameLen});
+                }
+                if (!sink.startElement(name, nameLen, attrs, selfClosing)) return false;
+                if (selfClosing && !sink.endElement(name, nameLen)) return false;
+            }
+        }
+        if (!open.empty()) {
+            pos = end;
+            return fail("unclosed element <" + std::string(open.back().first, open.back().second) + ">");
+        }
+        return true;
+    }
+
+    std::string error;
+
+private:
+    bool startsWith(const char* s) {
+        size_t len = strlen(s);
+        return (size_t)(end - pos) >= len && memcmp(pos, s, len) == 0;
+    }
+
+    const char* find(const char* s, size_t len) {
+        for (const char* p = pos; p + len <= end; p++) {
+            p = (const char*)memchr(p, s[0], end - p);
+            if (!p || p + len > end) {
+                return nullptr;
+            }
+            if (memcmp(p, s, len) == 0) {
+                return p;
+            }
+        }
+        return nullptr;
+    }
+
+    bool skipPast(const char* s, size_t len) {
+        const char* p = find(s, len);
+        if (!p) {
+            return false;
+        }
+        pos = p + len;
+        return true;
+    }
+
+    // <!DOCTYPE ...> may have an internal subset in brackets
+    bool skipDoctype() {
+        int depth = 0;
+        for (; pos < end; pos++) {
+            if (*pos == '[') {
+                depth++;
+            } else if (*pos == ']') {
+                depth--;
+            } else if (*pos == '>' && depth <= 0) {
+                pos++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    static bool isBlank(const char* p, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            if (!isSpace(p[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void skipSpace() {
+        while (pos < end && isSpace(*pos)) {
+            pos++;
+        }
+    }
+
+    size_t readName() {
+        const char* start = pos;
+        while (pos < end && !isSpace(*pos) && *pos != '>' && *pos != '/' && *pos != '=' && *pos != '<') {
+            pos++;
+        }
+        return pos - start;
+    }
+
+    bool fail(const std::string& message) {
+        int line = 1;
+        for (const char* p = data; p < pos && p < end; p++) {
+            if (*p == '\n') {
+                line++;
+            }
+        }
+        error = "line " + std::to_string(line) + ": " + message;
+        return false;
+    }
+
+    const char* data;
+    const char* pos;
+    const char* end;
+    std::vector<XMLAttr> attrs;
+};
+
+// Builds the same tables as xml.lua: a list of top level nodes, each node being
+// { elem = name, attrib = { name = value }, child nodes and text strings in order }
+class XMLTreeSink {
+public:
+    XMLTreeSink(lua_State* LState) : L(LState) {
+        lua_newtable(L);
+        counts.push_back(0);
+    }
+
+    bool startElement(const char* name, size_t nameLen, const std::vector<XMLAttr>& attrs, bool selfClosing) {
+        luaL_checkstack(L, 4, "XML nested too deeply");
+        lua_createtable(L, 0, 2);
+        lua_pushlstring(L, name, nameLen);
+        lua_setfield(L, -2, "elem");
+        lua_createtable(L, 0, (int)attrs.size());
+        for (auto& attr : attrs) {
+            lua_pushlstring(L, attr.name, attr.nameLen);
+            PushXMLText(L, attr.value, attr.valueLen, scratch);
+            lua_rawset(L, -3);
+        }
+        lua_setfield(L, -2, "attrib");
+        counts.push_back(0);
+        return true;
+    }
+
+    bool endElement(const char*, size_t) {
+        counts.pop_back();
+        lua_rawseti(L, -2, ++counts.back());
+        return true;
+    }
+
+    bool text(const char* p, size_t len, bool escaped) {
+        if (escaped) {
+            PushXMLText(L, p, len, scratch);
+        } else {
+            lua_pushlstring(L, p, len);
+        }
+        lua_rawseti(L, -2, ++counts.back());
+        return true;
+    }
+
+private:
+    lua_State* L;
+    std::vector<int> counts;
+    std::string scratch;
+};
+
+// Calls StartElement(name, attrib), EndElement(name) and Text(text) from a handler table.
+// Missing handlers are skipped; a handler returning false stops the parse.
+class XMLCallbackSink {
+public:
+    XMLCallbackSink(lua_State* LState, int Handlers) : L(LState), handlers(Handlers), stopped(false) {}
+
+    bool startElement(const char* name, size_t nameLen, const std::vector<XMLAttr>& attrs, bool selfClosing) {
+        if (!getHandler("StartElement")) {
+            return true;
+        }
+        lua_pushlstring(L, name, nameLen);
+        lua_createtable(L, 0, (int)attrs.size());
+        for (auto& attr : attrs) {
+            lua_pushlstring(L, attr.name, attr.nameLen);
+            PushXMLText(L, attr.value, attr.valueLen, scratch);
+            lua_rawset(L, -3);
+        }
+        return call(2);
+    }
+
+    bool endElement(const char* name, size_t nameLen) {
+        if (!getHandler("EndElement")) {
+            return true;
+        }
+        lua_pushlstring(L, name, nameLen);
+        return call(1);
+    }
+
+    bool text(const char* p, size_t len, bool escaped) {
+        if (!getHandler("Text")) {
+            return true;
+        }
+        if (escaped) {
+            PushXMLText(L, p, len, scratch);
+        } else {
+            lua_pushlstring(L, p, len);
+        }
+        return call(1);
+    }
+
+    std::string error;
+    bool stopped;
+
+private:
+    bool getHandler(const char* name) {
+        lua_getfield(L, handlers, name);
+        if (lua_isfunction(L, -1)) {
+            return true;
+        }
+        lua_pop(L, 1);
+        return false;
+    }
+
+    bool call(int nargs) {
+        if (lua_pcall(L, nargs, 1, 0) != 0) {
+            error = lua_tostring(L, -1) ? lua_tostring(L, -1) : "error in XML handler";
+            lua_pop(L, 1);
+            return false;
+        }
+        stopped = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        return !stopped;
+    }
+
+    lua_State* L;
+    int handlers;
+    std::string scratch;
+};
+
+// Shared by ParseXML() and ParseXMLFile(): returns the node list, or true in handler mode, or nil and a message
+static int ParseXMLBuffer(lua_State* L, const char* data, size_t len, int handlers)
+{
+    XMLParser parser(data, len);
+    if (handlers) {
+        XMLCallbackSink sink(L, handlers);
+        if (parser.parse(sink) || sink.stopped) {
+            lua_pushboolean(L, 1);
+            return 1;
+        }
+        lua_pushnil(L);
+        lua_pushstring(L, sink.error.empty() ? parser.error.c_str() : sink.error.c_str());
+        return 2;
+    }
+    int top = lua_gettop(L);
+    XMLTreeSink sink(L);
+    if (parser.parse(sink)) {
+        return 1;
+    }
+    lua_settop(L, top);
+    lua_pushnil(L);
+    lua_pushstring(L, parser.error.c_str());
+    return 2;
+}
+
+static int l_ParseXML(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1 || !(lua_isstring(L, 1) || ToBlob(L, 1))) {
+        return luaL_error(L, "Usage: ParseXML(string[, handlers])");
+    }
+    if (n >= 2 && !lua_isnil(L, 2) && !lua_istable(L, 2)) {
+        return luaL_error(L, "ParseXML() argument 2: expected table or nil, got %s", luaL_typename(L, 2));
+    }
+    size_t len;
+    const char* data = ToBytes(L, 1, &len);
+    return ParseXMLBuffer(L, data, len, n >= 2 && lua_istable(L, 2) ? 2 : 0);
+}
+
+// Parses a file in place through a memory mapping rather than reading it into a Lua string first
+static int l_ParseXMLFile(lua_State* L)
+{
+    int n = lua_gettop(L);
+    if (n < 1 || !lua_isstring(L, 1)) {
+        return luaL_error(L, "Usage: ParseXMLFile(fileName[, handlers])");
+    }
+    if (n >= 2 && !lua_isnil(L, 2) && !lua_istable(L, 2)) {
+        return luaL_error(L, "ParseXMLFile() argument 2: expected table or nil, got %s", luaL_typename(L, 2));
+    }
+    QFile file(QString::fromUtf8(lua_tostring(L, 1)));
+    if (!file.open(QFile::ReadOnly)) {
+        lua_pushnil(L);
+        lua_pushfstring(L, "couldn't open '%s'", lua_tostring(L, 1));
+        return 2;
+    }
+    int handlers = n >= 2 && lua_istable(L, 2) ? 2 : 0;
+    if (file.size() == 0) {
+        return ParseXMLBuffer(L, "", 0, handlers);
+    }
+    uchar* data = file.map(0, file.size());
+    if (!data) {
+        QByteArray contents = file.readAll();
+        return ParseXMLBuffer(L, contents.constData(), contents.size(), handlers);
+    }
+    int ret = ParseXMLBuffer(L, (const char*)data, (size_t)file.size(), handlers);
+    file.unmap(data);
+    return ret;
+}
+
+static void RegisterXML(lua_State* L)
+{
+    lua_pushcfunction(L, l_ParseXML);
+    lua_setglobal(L, "ParseXML");
+    lua_pushcfunction(L, l_ParseXMLFile);
+    lua_setglobal(L, "ParseXMLFile");
+}
+
+#endif